@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2024 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <l4/sys/types.h>
+
+#include <cstring>
+
+/**
+ * \ingroup virtio_net_switch
+ * \{
+ */
+
+/**
+ * Internet checksum (RFC 1071) computed over several chunks of a packet.
+ *
+ * The one's complement sum does not depend on the byte order as long as
+ * the result is compared in the same order, so chunks are summed in native
+ * 32-bit words into a 64-bit accumulator. The loop has no carry handling
+ * and no data dependencies besides the accumulator, so the compiler
+ * vectorizes it. Chunks starting at an odd offset of the packet are byte
+ * swapped before they are added.
+ */
+class Inet_checksum
+{
+public:
+  /**
+   * Add a chunk of the packet.
+   *
+   * \param data  Start of the chunk.
+   * \param len   Length of the chunk in bytes.
+   */
+  void add(void const *data, l4_size_t len)
+  {
+    auto const *p = static_cast<l4_uint8_t const *>(data);
+    l4_uint64_t sum = 0;
+
+    for (; len >= 16; p += 16, len -= 16)
+      {
+        l4_uint32_t w[4];
+        memcpy(w, p, sizeof(w));
+        sum += w[0];
+        sum += w[1];
+        sum += w[2];
+        sum += w[3];
+      }
+
+    for (; len >= 4; p += 4, len -= 4)
+      {
+        l4_uint32_t w;
+        memcpy(&w, p, sizeof(w));
+        sum += w;
+      }
+
+    for (; len >= 2; p += 2, len -= 2)
+      {
+        l4_uint16_t w;
+        memcpy(&w, p, sizeof(w));
+        sum += w;
+      }
+
+    bool odd_chunk = false;
+    if (len)
+      {
+        l4_uint8_t last[2] = { *p, 0 };
+        l4_uint16_t w;
+        memcpy(&w, last, sizeof(w));
+        sum += w;
+        odd_chunk = true;
+      }
+
+    l4_uint16_t folded = fold(sum);
+    if (_odd)
+      folded = (folded << 8) | (folded >> 8);
+
+    _sum += folded;
+    _odd ^= odd_chunk;
+  }
+
+  /** Add a 16-bit value given in host byte order. */
+  void add_u16(l4_uint16_t value)
+  {
+    l4_uint8_t be[2] = { static_cast<l4_uint8_t>(value >> 8),
+                         static_cast<l4_uint8_t>(value) };
+    add(be, sizeof(be));
+  }
+
+  /**
+   * Get the checksum to store into the checksum field, in the byte order of
+   * the packet.
+   */
+  l4_uint16_t result() const
+  { return ~fold(_sum); }
+
+  /** Check whether the packet including its checksum field sums up to 0. */
+  bool valid() const
+  { return fold(_sum) == 0xffff; }
+
+private:
+  static l4_uint16_t fold(l4_uint64_t sum)
+  {
+    while (sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+    return static_cast<l4_uint16_t>(sum);
+  }
+
+  l4_uint64_t _sum = 0;
+  /// The next chunk starts at an odd offset of the packet.
+  bool _odd = false;
+};
+
+/**\}*/
@@ -0,0 +1,512 @@
+/*
+ * Copyright (C) 2024 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#include <l4/re/consts>
+#include <l4/re/env>
+#include <l4/re/error_helper>
+#include <l4/sys/factory>
+#include <l4/sys/scheduler>
+#include <l4/sys/thread.h>
+
+#include <pthread-l4.h>
+
+#include "copy_worker.h"
+#include "debug.h"
+#include "port.h"
+
+Worker_transfer::Worker_transfer(Virtio_net_request::Request_ptr request,
+                                 Virtio_port *port,
+                                 L4virtio::Svr::Virtqueue *dst_queue,
+                                 const Virtio_vlan_mangle &mangle,
+                                 Copy_queue *queue)
+: Virtio_net_transfer(request, port, dst_queue, port->stats(), mangle),
+  _port{port},
+  _queue{queue}
+{}
+
+Worker_transfer::Worker_transfer(Virtio_net_request::Request_ptr request,
+                                 Virtio_net::Hdr const *header,
+                                 Buffer const &frame, Virtio_port *port,
+                                 L4virtio::Svr::Virtqueue *dst_queue,
+                                 const Virtio_vlan_mangle &mangle,
+                                 Copy_queue *queue)
+: Virtio_net_transfer(request, header, frame, port, dst_queue, port->stats(),
+                      mangle),
+  _port{port},
+  _queue{queue}
+{}
+
+Worker_transfer::Worker_transfer(Local_frame *frame, Virtio_port *port,
+                                 L4virtio::Svr::Virtqueue *dst_queue,
+                                 const Virtio_vlan_mangle &mangle,
+                                 Copy_queue *queue)
+: Virtio_net_transfer(frame, port, dst_queue, port->stats(), mangle),
+  _port{port},
+  _queue{queue}
+{}
+
+void
+Worker_transfer::expired()
+{
+  if (!started())
+    {
+      Virtio_net_transfer::expired();
+      return;
+    }
+
+  Dbg(Dbg::Queue, Dbg::Debug, "Queue")
+    .printf("Timeout expired: %p (finished by copy worker)\n", this);
+
+  Pending_list::remove(this);
+  _queue->submit_finish(this);
+}
+
+bool
+Copy_queue::submit(Copy_job::Op op, Worker_transfer *transfer)
+{
+  if (!can_submit())
+    return false;
+
+  // Cannot fail, there are never more than Ring_size jobs in flight.
+  _jobs.push(Copy_job{transfer, op, false, 0});
+  ++_in_flight;
+
+  // Pairs with the fence in Copy_worker::serve(): either the serving worker
+  // sees the new job before it releases the queue or we see the queue
+  // released and schedule it again.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!_scheduled.exchange(true))
+    _pool->schedule(this);
+
+  return true;
+}
+
+bool
+Copy_queue::submit(Worker_transfer *transfer)
+{ return submit(Copy_job::Copy, transfer); }
+
+void
+Copy_queue::submit_finish(Worker_transfer *transfer)
+{
+  while (!submit(Copy_job::Finish, transfer))
+    {
+      _pool->process_completions();
+      l4_thread_yield();
+    }
+}
+
+bool
+Copy_queue::resume()
+{
+  if (!_stalled.load(std::memory_order_acquire))
+    return true;
+
+  // Jobs still in flight are handed back and must be sorted in before the
+  // queue takes transfers again.
+  if (_in_flight)
+    return false;
+
+  // Pairs with the acquire in Copy_worker::serve(), the ring pushes of
+  // later jobs order this store before the worker sees the jobs.
+  _stalled.store(false, std::memory_order_release);
+  return true;
+}
+
+void
+Copy_queue::drain()
+{
+  // The worker serving the queue still notifies the guest of the port after
+  // publishing the last completion. The port is only unused once the worker
+  // released the queue.
+  while (_in_flight || _scheduled.load())
+    {
+      _pool->process_completions();
+      if (_in_flight || _scheduled.load())
+        l4_thread_yield();
+    }
+}
+
+Copy_worker::Copy_worker(unsigned id, unsigned cpu, Copy_pool *pool,
+                         Worker_statistics *stats)
+: _id{id}, _cpu{cpu}, _pool{pool}, _stats{stats}
+{
+  _stats->cpu = cpu == Copy_queue::No_cpu ? Worker_statistics::No_cpu : cpu;
+
+  _wakeup_irq = L4Re::chkcap(L4Re::Util::make_unique_del_cap<L4::Irq>(),
+                             "Allocate copy worker wakeup IRQ.");
+  L4Re::chksys(L4Re::Env::env()->factory()->create(_wakeup_irq.get()),
+               "Create copy worker wakeup IRQ.");
+}
+
+void
+Copy_worker::start()
+{
+  if (pthread_create(&_thread, nullptr, thread_fn, this))
+    throw L4::Runtime_error(-L4_ENOMEM, "Create copy worker thread");
+
+  if (_cpu != Copy_queue::No_cpu)
+    {
+      // The wakeup IRQ is bound to the thread, so it follows the thread.
+      l4_sched_param_t sp = l4_sched_param(L4RE_MAIN_THREAD_PRIO);
+      sp.affinity = l4_sched_cpu_set(_cpu, 0);
+      L4Re::chksys(L4Re::Env::env()->scheduler()
+                     ->run_thread(L4::Cap<L4::Thread>(pthread_l4_cap(_thread)),
+                                  sp),
+                   "Pin copy worker thread to CPU.");
+    }
+
+  // The worker binds the wakeup IRQ to itself before it may be triggered.
+  while (!_ready.load(std::memory_order_acquire))
+    l4_thread_yield();
+
+  if (_cpu != Copy_queue::No_cpu)
+    Dbg(Dbg::Core, Dbg::Info).printf("Copy worker %u started on CPU %u\n",
+                                     _id, _cpu);
+  else
+    Dbg(Dbg::Core, Dbg::Info).printf("Copy worker %u started\n", _id);
+}
+
+void *
+Copy_worker::thread_fn(void *arg)
+{
+  static_cast<Copy_worker *>(arg)->run();
+  return nullptr;
+}
+
+void
+Copy_worker::enqueue(Copy_queue *queue)
+{
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _deque.push_back(queue);
+  }
+  _num_queued.fetch_add(1);
+}
+
+Copy_queue *
+Copy_worker::pop()
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  if (_deque.empty())
+    return nullptr;
+
+  if (_deque.size() > _stats->max_backlog)
+    _stats->max_backlog = _deque.size();
+
+  Copy_queue *queue = _deque.front();
+  _deque.pop_front();
+  _num_queued.fetch_sub(1);
+  return queue;
+}
+
+Copy_queue *
+Copy_worker::steal()
+{
+  // Cheap check to avoid contending for the lock of idle workers.
+  if (!_num_queued.load(std::memory_order_relaxed))
+    return nullptr;
+
+  std::lock_guard<std::mutex> guard(_lock);
+  if (_deque.empty())
+    return nullptr;
+
+  Copy_queue *queue = _deque.back();
+  _deque.pop_back();
+  _num_queued.fetch_sub(1);
+  return queue;
+}
+
+void
+Copy_worker::wait_for_work()
+{
+  _sleeping.store(true, std::memory_order_relaxed);
+  // Pairs with the fence in Copy_pool::schedule(): either we see the queued
+  // work or the scheduler sees us sleeping and wakes us up.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  if (!_pool->work_available())
+    _wakeup_irq->receive();
+
+  _sleeping.store(false, std::memory_order_relaxed);
+}
+
+void
+Copy_worker::copy(Copy_job *job)
+{
+  Worker_transfer *transfer = job->transfer;
+
+  if (job->op == Copy_job::Finish)
+    {
+      transfer->finish_transfer();
+      job->done = true;
+      return;
+    }
+
+  auto *rx_q = transfer->port()->rx_q();
+  job->avail_idx = rx_q->ready() ? rx_q->avail_idx() : 0;
+
+  try
+    {
+      job->done = transfer->transfer();
+    }
+  catch (L4::Runtime_error const &e)
+    {
+      Err().printf("Copy worker %u: %s\n", _id, e.str());
+      job->done = true;
+    }
+  catch (L4virtio::Svr::Bad_descriptor const &e)
+    {
+      Err().printf("Copy worker %u: bad descriptor: %s\n", _id, e.message());
+      job->done = true;
+    }
+
+  // Never leave a dropped transfer to the server thread half-finished.
+  if (job->done)
+    transfer->finish_transfer();
+}
+
+void
+Copy_worker::complete(Copy_job const &job)
+{
+  // The completion ring is shared by all queues this worker serves. If the
+  // server thread lags behind, wait for it instead of dropping the job.
+  while (!_completions.push(job))
+    {
+      _pool->_completion_irq->trigger();
+      l4_thread_yield();
+    }
+}
+
+void
+Copy_worker::serve(Copy_queue *queue)
+{
+  Copy_job batch[Batch_size];
+  unsigned num = 0;
+  while (num < Batch_size && queue->_jobs.pop(&batch[num]))
+    ++num;
+
+  if (num)
+    {
+      // All jobs of a queue target the same port. Defer the guest
+      // notification until the whole batch is copied.
+      Virtio_port *port = batch[0].transfer->port();
+      port->kick_disable_and_remember(Virtio_net::Rx_queue);
+
+      for (unsigned i = 0; i < num; ++i)
+        {
+          // Once the receive queue ran out of buffers, hand all later copies
+          // back untouched, so the server thread can keep them in order.
+          if (   batch[i].op == Copy_job::Copy
+              && queue->_stalled.load(std::memory_order_acquire))
+            batch[i].avail_idx = queue->_stall_avail_idx;
+          else
+            {
+              copy(&batch[i]);
+              if (!batch[i].done)
+                {
+                  queue->_stall_avail_idx = batch[i].avail_idx;
+                  queue->_stalled.store(true, std::memory_order_release);
+                }
+            }
+          complete(batch[i]);
+        }
+
+      {
+        Stage_timer publish(Stage_publish);
+        port->kick_emit_and_enable(Virtio_net::Rx_queue);
+      }
+      _pool->_completion_irq->trigger();
+
+      _stats->jobs += num;
+      ++_stats->services;
+      // Cache lines of the rings and buffers bounce between CPUs.
+      if (queue->_cpu != Copy_queue::No_cpu && queue->_cpu != _cpu)
+        _stats->remote_jobs += num;
+    }
+
+  // Release the queue. Pairs with the fence in Copy_queue::submit(): if the
+  // server thread added a job in the meantime, but saw the queue still
+  // scheduled, we have to schedule it again. Keep it on our own deque, other
+  // workers steal it if they run out of work.
+  queue->_scheduled.store(false);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!queue->_jobs.empty() && !queue->_scheduled.exchange(true))
+    _pool->schedule(queue, this);
+}
+
+void
+Copy_worker::run()
+{
+  L4Re::chksys(_wakeup_irq->bind_thread(L4::Cap<L4::Thread>(
+                                          pthread_l4_cap(pthread_self())), 0),
+               "Bind copy worker wakeup IRQ.");
+  Stage_timer::set_thread_stages(_stats->stages);
+  _ready.store(true, std::memory_order_release);
+
+  unsigned num_workers = _pool->_workers.size();
+  for (;;)
+    {
+      Copy_queue *queue = pop();
+
+      for (unsigned i = 1; !queue && i < num_workers; ++i)
+        {
+          queue = _pool->_workers[(_id + i) % num_workers]->steal();
+          if (queue)
+            ++_stats->steals;
+        }
+
+      if (!queue)
+        {
+          ++_stats->sleeps;
+          wait_for_work();
+          continue;
+        }
+
+      serve(queue);
+    }
+}
+
+Copy_pool::Copy_pool(unsigned num_workers, std::vector<unsigned> const &cpus,
+                     L4Re::Util::Object_registry *registry)
+: _completion_ep{this}
+{
+  _completion_irq = L4Re::chkcap(registry->register_irq_obj(&_completion_ep),
+                                 "Register copy worker completion IRQ.");
+
+  Switch_statistics *stats = Statistics::get();
+  stats->num_workers = num_workers;
+
+  for (unsigned i = 0; i < num_workers; ++i)
+    _workers.push_back(new Copy_worker(i,
+                                       i < cpus.size() ? cpus[i]
+                                                       : Copy_queue::No_cpu,
+                                       this, &stats->workers[i]));
+
+  // Workers look at the complete worker list when they steal, so the list
+  // must not change after the first worker started.
+  for (auto *worker : _workers)
+    worker->start();
+}
+
+Copy_queue *
+Copy_pool::create_queue(unsigned cpu)
+{
+  Copy_queue *queue;
+  if (!_free_queues.empty())
+    {
+      queue = _free_queues.back();
+      _free_queues.pop_back();
+    }
+  else
+    {
+      queue = new Copy_queue(this);
+      _queues.push_back(queue);
+    }
+
+  // Set before the first job is pushed, workers only look at these fields
+  // while serving jobs.
+  queue->_cpu = cpu;
+  queue->_home = nullptr;
+  queue->_stalled.store(false);
+  if (cpu != Copy_queue::No_cpu)
+    {
+      for (auto *worker : _workers)
+        if (worker->_cpu == cpu)
+          {
+            queue->_home = worker;
+            break;
+          }
+
+      if (!queue->_home)
+        Dbg(Dbg::Port, Dbg::Warn)
+          .printf("No copy thread on CPU %u, placing port round-robin\n",
+                  cpu);
+    }
+
+  if (!queue->_home)
+    {
+      queue->_home = _workers[_next_home];
+      _next_home = (_next_home + 1) % _workers.size();
+    }
+
+  return queue;
+}
+
+void
+Copy_pool::drain()
+{
+  for (auto *queue : _queues)
+    queue->drain();
+}
+
+void
+Copy_pool::schedule(Copy_queue *queue, Copy_worker *worker)
+{
+  if (!worker)
+    worker = queue->_home;
+
+  worker->enqueue(queue);
+
+  // Pairs with the fence in Copy_worker::wait_for_work().
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (worker->_sleeping.load(std::memory_order_relaxed))
+    {
+      worker->_wakeup_irq->trigger();
+      return;
+    }
+
+  // The worker is busy, let an idle worker steal the queue.
+  for (auto *w : _workers)
+    if (w != worker && w->_sleeping.load(std::memory_order_relaxed))
+      {
+        __atomic_fetch_add(&Statistics::get()->steal_wakeups, 1,
+                           __ATOMIC_RELAXED);
+        w->_wakeup_irq->trigger();
+        return;
+      }
+}
+
+bool
+Copy_pool::work_available() const
+{
+  for (auto *w : _workers)
+    if (w->_num_queued.load(std::memory_order_relaxed))
+      return true;
+
+  return false;
+}
+
+void
+Copy_pool::process_completions()
+{
+  Copy_job job;
+  for (auto *worker : _workers)
+    while (worker->_completions.pop(&job))
+      {
+        Copy_queue *queue = job.transfer->queue();
+        --queue->_in_flight;
+
+        if (job.done)
+          {
+            job.transfer->port()->map_guest_mem(job.transfer->dst_buffer());
+            delete job.transfer;
+            continue;
+          }
+
+        // The receive queue was full and the worker stalled the queue.
+        // Retrying the job now would pass later jobs still in flight.
+        Virtio_port *port = job.transfer->port();
+        port->requeue_transfer(job.transfer);
+
+        // All jobs of the stall are back. If the guest added buffers since
+        // the failed attempt, its kick might already have been handled, so
+        // retry right away instead of waiting for the next kick.
+        if (   !queue->_in_flight
+            && port->rx_q()->ready()
+            && port->rx_q()->avail_idx() != job.avail_idx)
+          port->resubmit_pending_requests();
+      }
+}
@@ -0,0 +1,368 @@
+/*
+ * Copyright (C) 2024 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <l4/re/util/object_registry>
+#include <l4/re/util/unique_cap>
+#include <l4/sys/cxx/ipc_epiface>
+#include <l4/sys/irq>
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <pthread.h>
+#include <vector>
+
+#include "spsc_ring.h"
+#include "stats.h"
+#include "transfer.h"
+
+class Virtio_port;
+class Copy_queue;
+class Copy_worker;
+class Copy_pool;
+
+/**
+ * \ingroup virtio_net_switch
+ * \{
+ */
+
+/**
+ * A transfer whose copy operation is executed by a copy worker thread.
+ *
+ * The server thread creates, queues and deletes these transfers. The copy
+ * worker only executes `transfer()` or `finish_transfer()` on them, which are
+ * the only operations touching the receive queue of the destination port.
+ */
+class Worker_transfer : public Virtio_net_transfer
+{
+public:
+  Worker_transfer(Virtio_net_request::Request_ptr request, Virtio_port *port,
+                  L4virtio::Svr::Virtqueue *dst_queue,
+                  const Virtio_vlan_mangle &mangle, Copy_queue *queue);
+
+  /** Create a transfer of a frame in a local buffer. */
+  Worker_transfer(Virtio_net_request::Request_ptr request,
+                  Virtio_net::Hdr const *header, Buffer const &frame,
+                  Virtio_port *port, L4virtio::Svr::Virtqueue *dst_queue,
+                  const Virtio_vlan_mangle &mangle, Copy_queue *queue);
+
+  /** Create a transfer of a frame owned by the transfer. */
+  Worker_transfer(Local_frame *frame, Virtio_port *port,
+                  L4virtio::Svr::Virtqueue *dst_queue,
+                  const Virtio_vlan_mangle &mangle, Copy_queue *queue);
+
+  /** The destination port of the transfer. */
+  Virtio_port *port() const
+  { return _port; }
+
+  /** The copy queue of the destination port. */
+  Copy_queue *queue() const
+  { return _queue; }
+
+  /** Set the position of the transfer in the packet order of the port. */
+  void set_seq(l4_uint32_t seq)
+  { _seq = seq; }
+
+  /** Check whether the transfer is ordered before another one. */
+  bool before(Worker_transfer const *other) const
+  { return static_cast<l4_int32_t>(_seq - other->_seq) < 0; }
+
+private:
+  /**
+   * Callback for the timeout.
+   *
+   * A transfer that already consumed buffers of the receive queue must be
+   * finished by a copy worker. Otherwise the server thread would write to
+   * the receive queue concurrently to the copy worker.
+   */
+  void expired() override;
+
+  Virtio_port *_port;
+  Copy_queue *_queue;
+  l4_uint32_t _seq = 0;
+};
+
+/**
+ * A copy operation handed from the server thread to a copy worker.
+ */
+struct Copy_job
+{
+  enum Op : l4_uint8_t { Copy, Finish };
+
+  Worker_transfer *transfer;
+  Op op;
+  /// Set by the worker if the transfer was completed.
+  bool done;
+  /// Avail index of the receive queue seen before an attempt failed.
+  l4_uint16_t avail_idx;
+};
+
+/**
+ * Copy jobs for the receive queue of a single port.
+ *
+ * The queue is the unit of work distribution between the copy workers. A
+ * queue is scheduled on at most one worker at a time, the `scheduled` flag
+ * is owned by whoever set it. So although a queue may move between workers,
+ * it always has a single consumer and the receive queue of the port has a
+ * single producer.
+ *
+ * Queues are never freed, a queue released by a removed port is reused for
+ * the next port. A worker might still look at a queue right after the last
+ * job of a port completed.
+ *
+ * If a copy fails because the receive queue has no buffers left, the worker
+ * stalls the queue: it hands the failed job and all later ones back to the
+ * server thread without attempting them. The server thread puts them back
+ * into the pending requests of the port in their original order and only
+ * resumes the queue once all of them are back. So packets to a port are
+ * never reordered while its receive queue is full.
+ */
+class Copy_queue
+{
+  friend class Copy_pool;
+  friend class Copy_worker;
+
+public:
+  enum : unsigned
+  {
+    Ring_size = 512,  ///< Maximum number of transfers in flight
+    No_cpu = ~0U,     ///< No CPU preference
+  };
+
+  /**
+   * Hand a transfer to the copy workers (server thread only).
+   *
+   * \param transfer  Transfer to execute.
+   *
+   * \retval true   A worker took over the transfer.
+   * \retval false  The queue is full; the caller keeps ownership of the
+   *                transfer.
+   */
+  bool submit(Worker_transfer *transfer);
+
+  /**
+   * Let a copy worker finish a partially executed transfer (server thread
+   * only).
+   *
+   * \param transfer  Transfer to finish. The worker takes over the transfer.
+   */
+  void submit_finish(Worker_transfer *transfer);
+
+  /** Check whether the queue accepts more transfers (server thread only). */
+  bool can_submit() const
+  { return _in_flight < Ring_size; }
+
+  /**
+   * Check whether the queue is not stalled or may be resumed (server thread
+   * only).
+   */
+  bool can_resume() const
+  { return !_in_flight || !_stalled.load(std::memory_order_acquire); }
+
+  /**
+   * Resume a stalled queue (server thread only).
+   *
+   * \retval true   The queue is not stalled (anymore).
+   * \retval false  The workers still have to hand back jobs of the stalled
+   *                queue.
+   */
+  bool resume();
+
+  /** Number the next transfer to the port (server thread only). */
+  l4_uint32_t next_seq()
+  { return _next_seq++; }
+
+  /**
+   * Wait until the workers completed all transfers of this queue and
+   * released it (server thread only).
+   *
+   * Must be called before the receive queue of the port is reset or before
+   * the port is deleted.
+   */
+  void drain();
+
+private:
+  explicit Copy_queue(Copy_pool *pool) : _pool{pool} {}
+
+  bool submit(Copy_job::Op op, Worker_transfer *transfer);
+
+  Copy_pool *_pool;
+  /// Worker the queue is scheduled on unless another worker steals it.
+  Copy_worker *_home = nullptr;
+  /// CPU preferred by the port, Copy_queue::No_cpu if none.
+  unsigned _cpu = No_cpu;
+  Spsc_ring<Copy_job, Ring_size> _jobs; ///< server thread -> serving worker
+  std::atomic<bool> _scheduled{false};
+  /// Set by a worker if the receive queue was full, cleared by the server.
+  std::atomic<bool> _stalled{false};
+  /// Avail index of the receive queue seen by the failed job of a stall.
+  l4_uint16_t _stall_avail_idx = 0;
+  /// Number of submitted jobs not yet processed by the server thread.
+  unsigned _in_flight = 0;
+  /// Position of the next transfer in the packet order (server thread only).
+  l4_uint32_t _next_seq = 0;
+};
+
+/**
+ * A copy worker thread of the switch pipeline.
+ *
+ * Each worker keeps a deque of scheduled copy queues. It serves the queues at
+ * the front of its own deque; if its deque is empty, it steals a queue from
+ * the back of the deque of another worker before it goes to sleep. Thus a
+ * few hot ports homed on the same worker get spread over idle workers.
+ *
+ * The deques are short (at most one entry per port) and protected by a
+ * mutex; the per-packet path through the job and completion rings stays
+ * lock-free.
+ */
+class Copy_worker
+{
+  friend class Copy_pool;
+
+public:
+  /**
+   * Create a copy worker.
+   *
+   * \param id     Number of the worker used in debug output.
+   * \param cpu    CPU to pin the worker thread to, Copy_queue::No_cpu to
+   *               leave the placement to the scheduler.
+   * \param pool   The pool the worker belongs to.
+   * \param stats  Statistics of the worker.
+   */
+  Copy_worker(unsigned id, unsigned cpu, Copy_pool *pool,
+              Worker_statistics *stats);
+
+  /** Start the worker thread. */
+  void start();
+
+private:
+  enum { Batch_size = 32 };  ///< Maximum number of jobs served in one go
+
+  static void *thread_fn(void *arg);
+  void run();
+  void wait_for_work();
+
+  /** Add a scheduled queue to the back of the deque (any thread). */
+  void enqueue(Copy_queue *queue);
+  /** Take a queue from the front of the own deque (worker only). */
+  Copy_queue *pop();
+  /** Take a queue from the back of the deque (thieves). */
+  Copy_queue *steal();
+
+  /** Serve a batch of jobs of a queue and release it. */
+  void serve(Copy_queue *queue);
+  void copy(Copy_job *job);
+  void complete(Copy_job const &job);
+
+  unsigned _id;
+  unsigned _cpu;
+  Copy_pool *_pool;
+  Worker_statistics *_stats;
+
+  std::mutex _lock;
+  std::deque<Copy_queue *> _deque; ///< protected by `_lock`
+  std::atomic<unsigned> _num_queued{0};
+
+  Spsc_ring<Copy_job, 2 * Copy_queue::Ring_size> _completions; ///< -> server
+  std::atomic<bool> _sleeping{false};
+  std::atomic<bool> _ready{false};
+
+  L4Re::Util::Unique_del_cap<L4::Irq> _wakeup_irq;
+  pthread_t _thread;
+};
+
+/**
+ * The copy worker threads of the switch pipeline.
+ *
+ * The server thread classifies packets and hands transfers to the copy queue
+ * of the destination port. The copy workers copy the packets into the receive
+ * queues and publish the used ring entries. Completed and failed jobs are
+ * handed back to the server thread by triggering an IRQ registered at the
+ * server.
+ */
+class Copy_pool
+{
+  friend class Copy_queue;
+  friend class Copy_worker;
+
+public:
+  /**
+   * Create the copy workers and start their threads.
+   *
+   * \param num_workers  Number of copy worker threads.
+   * \param cpus         CPUs to pin the first workers to, in order. Workers
+   *                     without an entry are not pinned.
+   * \param registry     Registry of the server thread for the completion IRQ.
+   */
+  Copy_pool(unsigned num_workers, std::vector<unsigned> const &cpus,
+            L4Re::Util::Object_registry *registry);
+
+  /**
+   * Get a copy queue for a new port (server thread only).
+   *
+   * \param cpu  CPU preferred by the port, Copy_queue::No_cpu if none.
+   *
+   * The queue is homed on a worker pinned to \a cpu, so the receive queue
+   * and the packet buffers of the port are written from that CPU. Queues
+   * without a preference are homed round-robin on the workers.
+   */
+  Copy_queue *create_queue(unsigned cpu = Copy_queue::No_cpu);
+
+  /**
+   * Return the copy queue of a removed port (server thread only).
+   *
+   * The queue must be drained.
+   */
+  void release_queue(Copy_queue *queue)
+  { _free_queues.push_back(queue); }
+
+  /**
+   * Wait until the workers completed all submitted transfers (server thread
+   * only).
+   */
+  void drain();
+
+  /** Process the transfers completed by the workers (server thread only). */
+  void process_completions();
+
+private:
+  /**
+   * IRQ endpoint of the server thread signalling completed jobs.
+   */
+  struct Completion_irq : public L4::Irqep_t<Completion_irq>
+  {
+    Copy_pool *pool;
+
+    explicit Completion_irq(Copy_pool *p) : pool{p} {}
+
+    void handle_irq()
+    { pool->process_completions(); }
+  };
+
+  /**
+   * Put a queue with pending jobs on the deque of a worker (any thread).
+   *
+   * \param queue   Queue whose `scheduled` flag the caller just set.
+   * \param worker  Worker to put the queue on, the home worker of the queue
+   *                if nullptr.
+   *
+   * If the worker is busy, an idle worker is woken up to steal the queue.
+   */
+  void schedule(Copy_queue *queue, Copy_worker *worker = nullptr);
+  /** Check whether any worker has queues waiting (any thread). */
+  bool work_available() const;
+
+  std::vector<Copy_worker *> _workers;
+  std::vector<Copy_queue *> _queues;
+  std::vector<Copy_queue *> _free_queues;
+  unsigned _next_home = 0;
+
+  Completion_irq _completion_ep;
+  L4::Cap<L4::Irq> _completion_irq;
+};
+/**\}*/
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2024 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <l4/sys/types.h>
+
+/**
+ * \ingroup virtio_net_switch
+ * \{
+ */
+
+/**
+ * Token bucket limiting the byte rate delivered to a port.
+ *
+ * The bucket fills with the configured rate up to the burst size. A packet
+ * may be delivered if the bucket holds enough tokens for it; packets larger
+ * than the burst size only need a full bucket.
+ */
+class Egress_shaper
+{
+public:
+  /**
+   * Set the rate of the shaper.
+   *
+   * \param rate   Rate in bytes per second, 0 to disable shaping.
+   * \param burst  Bucket size in bytes, 0 to use 10ms worth of the rate but
+   *               at least two full-sized Ethernet frames.
+   * \param now    Current time in microseconds (KIP clock).
+   */
+  void set_rate(l4_uint64_t rate, l4_uint64_t burst, l4_cpu_time_t now)
+  {
+    _rate = rate;
+    _burst = burst ? burst : rate / 100;
+    if (_burst < 2 * 1514)
+      _burst = 2 * 1514;
+    _tokens = _burst;
+    _last_refill = now;
+  }
+
+  /** Check whether the shaper limits the rate. */
+  bool active() const
+  { return _rate != 0; }
+
+  /**
+   * Take the tokens for a packet if available.
+   *
+   * \param bytes  Size of the packet.
+   * \param now    Current time in microseconds (KIP clock).
+   *
+   * \retval true   The packet may be delivered.
+   * \retval false  Not enough tokens, see ready_at().
+   */
+  bool consume(l4_uint64_t bytes, l4_cpu_time_t now)
+  {
+    refill(now);
+
+    l4_uint64_t need = bytes < _burst ? bytes : _burst;
+    if (_tokens < need)
+      return false;
+
+    _tokens -= need;
+    return true;
+  }
+
+  /**
+   * Get the time at which a packet may be delivered.
+   *
+   * \param bytes  Size of the packet.
+   * \param now    Current time in microseconds (KIP clock).
+   */
+  l4_cpu_time_t ready_at(l4_uint64_t bytes, l4_cpu_time_t now)
+  {
+    refill(now);
+
+    l4_uint64_t need = bytes < _burst ? bytes : _burst;
+    if (_tokens >= need)
+      return now;
+
+    return now + ((need - _tokens) * 1000000 + _rate - 1) / _rate;
+  }
+
+private:
+  void refill(l4_cpu_time_t now)
+  {
+    l4_cpu_time_t elapsed = now - _last_refill;
+    // Time to fill the whole bucket, also avoids overflows below.
+    if (elapsed >= _burst * 1000000 / _rate + 1)
+      {
+        _tokens = _burst;
+        _last_refill = now;
+        return;
+      }
+
+    l4_uint64_t tokens = elapsed * _rate / 1000000;
+    if (!tokens)
+      return;
+
+    // Advance by the time the tokens took to keep the remainder.
+    _last_refill += tokens * 1000000 / _rate;
+    _tokens = _tokens + tokens < _burst ? _tokens + tokens : _burst;
+  }
+
+  l4_uint64_t _rate = 0;    ///< Bytes per second
+  l4_uint64_t _burst = 0;   ///< Bucket size in bytes
+  l4_uint64_t _tokens = 0;
+  l4_cpu_time_t _last_refill = 0;
+};
+/**\}*/
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2024 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <l4/sys/types.h>
+
+/**
+ * \ingroup virtio_net_switch
+ * \{
+ */
+
+/**
+ * Cyclic gate control list of an egress port (IEEE 802.1Qbv style).
+ *
+ * Packets are assigned to one of eight traffic classes by the priority code
+ * point (PCP) of their VLAN tag, untagged packets belong to class 0. Each
+ * entry of the list opens the gates of a set of traffic classes for a
+ * duration; the gates of all other classes are closed. The schedule repeats
+ * after the sum of all durations. Cycles are aligned to the KIP clock, so
+ * ports with the same cycle time open their gates at the same time.
+ *
+ * A port without entries keeps all gates open.
+ */
+class Gate_control
+{
+public:
+  enum : unsigned
+  {
+    Max_entries = 16,  ///< Maximum number of entries of a list
+    Num_classes = 8,   ///< Number of traffic classes
+  };
+
+  /**
+   * Append an entry to the list.
+   *
+   * \param duration  Duration of the entry in microseconds.
+   * \param open      Bit mask of the traffic classes whose gates are open.
+   *
+   * \retval true   The entry was added.
+   * \retval false  The list is full or the duration is zero.
+   */
+  bool add(l4_cpu_time_t duration, l4_uint8_t open)
+  {
+    if (_num_entries >= Max_entries || !duration)
+      return false;
+
+    _entries[_num_entries++] = Entry{duration, open};
+    _cycle += duration;
+    return true;
+  }
+
+  /** Check whether the list controls the gates of the port. */
+  bool active() const
+  { return _num_entries != 0; }
+
+  /**
+   * Get the gate states at a point in time.
+   *
+   * \param      now          Time in microseconds (KIP clock).
+   * \param[out] next_change  Time at which the current entry ends.
+   *
+   * \return Bit mask of the traffic classes whose gates are open.
+   */
+  l4_uint8_t gates(l4_cpu_time_t now, l4_cpu_time_t *next_change) const
+  {
+    if (!_num_entries)
+      {
+        *next_change = ~0ULL;
+        return 0xff;
+      }
+
+    l4_cpu_time_t offset = now % _cycle;
+    for (unsigned i = 0; i < _num_entries; ++i)
+      {
+        if (offset < _entries[i].duration)
+          {
+            *next_change = now + (_entries[i].duration - offset);
+            return _entries[i].open;
+          }
+        offset -= _entries[i].duration;
+      }
+
+    // Not reached, the entries add up to the cycle time.
+    *next_change = now + 1;
+    return 0;
+  }
+
+private:
+  struct Entry
+  {
+    l4_cpu_time_t duration;
+    l4_uint8_t open;
+  };
+
+  Entry _entries[Max_entries];
+  unsigned _num_entries = 0;
+  l4_cpu_time_t _cycle = 0;
+};
+/**\}*/
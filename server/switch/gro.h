@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2024 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <l4/cxx/unique_ptr>
+#include <l4/sys/types.h>
+
+#include <cstring>
+
+#include "checksum.h"
+#include "request.h"
+#include "transfer.h"
+#include "vlan.h"
+
+/**
+ * \ingroup virtio_net_switch
+ * \{
+ */
+
+/**
+ * Receive-side coalescing of TCP segments for one destination port.
+ *
+ * Consecutive in-order segments of the same TCP flow are merged into one
+ * frame which is delivered as a TSO packet to a guest that negotiated
+ * VIRTIO_NET_F_GUEST_TSO4/6. The guest then processes one packet instead of
+ * many, and the switch uses one receive descriptor and one notification.
+ *
+ * A merged frame only collects segments from one source port within one
+ * processing round of the switch; it is flushed when a packet that does not
+ * fit arrives, when a segment is shorter than the previous ones or carries
+ * PSH, and at the end of the round.
+ */
+class Tcp_gro
+{
+public:
+  /** Location of the headers of a TCP segment. */
+  struct Segment
+  {
+    l4_uint32_t l3_off;   ///< Offset of the IP header
+    l4_uint32_t l4_off;   ///< Offset of the TCP header
+    l4_uint32_t hdr_len;  ///< Length of all headers
+    l4_uint32_t payload;  ///< Length of the TCP payload
+    l4_uint32_t seq;      ///< Sequence number
+    l4_uint8_t flags;     ///< TCP flags
+    bool ipv6;
+  };
+
+  /**
+   * Check whether a packet is a TCP segment that may be merged.
+   *
+   * \param      request  The packet.
+   * \param[out] seg      Header locations of the segment.
+   *
+   * Only plain data segments (ACK, optionally PSH) over IPv4 without options
+   * or IPv6 without extension headers, with all headers in the first buffer,
+   * are considered.
+   */
+  static bool parse(Virtio_net_request *request, Segment *seg)
+  {
+    Virtio_net::Hdr const *hdr = request->header();
+    if (hdr->gso_type != Virtio_net::Hdr::Gso_none)
+      return false;
+
+    Buffer const &pkt = request->first_buffer();
+    auto const *p = reinterpret_cast<l4_uint8_t const *>(pkt.pos);
+    l4_uint32_t left = pkt.left;
+    l4_uint32_t off = request->has_vlan() ? 16 : 12;
+    if (left < off + 2)
+      return false;
+
+    l4_uint32_t ip_len;
+    seg->ipv6 = p[off] == 0x86U && p[off + 1] == 0xddU;
+    seg->l3_off = off + 2;
+    l4_uint8_t const *ip = p + seg->l3_off;
+    if (p[off] == 0x08U && p[off + 1] == 0x00U)
+      {
+        if (   left < seg->l3_off + 20 || ip[0] != 0x45 || ip[9] != 6
+            || (ip[6] & 0x3fU) || ip[7])
+          return false;
+        ip_len = (l4_uint32_t)ip[2] << 8 | ip[3];
+        seg->l4_off = seg->l3_off + 20;
+      }
+    else if (seg->ipv6)
+      {
+        if (left < seg->l3_off + 40 || (ip[0] >> 4) != 6 || ip[6] != 6)
+          return false;
+        ip_len = 40 + ((l4_uint32_t)ip[4] << 8 | ip[5]);
+        seg->l4_off = seg->l3_off + 40;
+      }
+    else
+      return false;
+
+    if (left < seg->l4_off + 20)
+      return false;
+
+    l4_uint8_t const *tcp = p + seg->l4_off;
+    l4_uint32_t tcp_hdr_len = (tcp[12] >> 4) * 4;
+    seg->hdr_len = seg->l4_off + tcp_hdr_len;
+    seg->flags = tcp[13];
+    if (   tcp_hdr_len < 20 || left < seg->hdr_len
+        || (seg->flags & ~Tcp_psh) != Tcp_ack
+        || seg->l3_off + ip_len > request->length()
+        || seg->l3_off + ip_len <= seg->hdr_len)
+      return false;
+
+    if (   hdr->flags.need_csum()
+        && (hdr->csum_start != seg->l4_off || hdr->csum_offset != 16))
+      return false;
+
+    seg->payload = seg->l3_off + ip_len - seg->hdr_len;
+    seg->seq = (l4_uint32_t)tcp[4] << 24 | (l4_uint32_t)tcp[5] << 16
+               | (l4_uint32_t)tcp[6] << 8 | tcp[7];
+    return true;
+  }
+
+  /** Check whether segments are being merged. */
+  bool active() const
+  { return _frame.get() != nullptr; }
+
+  /**
+   * Start a merged frame with a segment.
+   *
+   * \param request   The segment.
+   * \param seg       Header locations of the segment.
+   * \param src       Source port of the segment.
+   * \param mangle    VLAN mangling of the segment for the destination.
+   * \param priority  Priority of the segment, see Gate_control.
+   *
+   * \retval true   The segment was copied.
+   * \retval false  The segment ends its flow burst (PSH), so there is nothing
+   *                to merge, or its descriptor chain is broken.
+   */
+  bool start(Virtio_net_request *request, Segment const &seg, void const *src,
+             Virtio_vlan_mangle const &mangle, l4_uint8_t priority)
+  {
+    if (seg.flags & Tcp_psh)
+      return false;
+
+    auto *frame = new Virtio_net_transfer::Local_frame();
+    frame->hdr = *request->header();
+    frame->data.reserve(Max_ip_len + seg.l3_off);
+    if (!request->copy_out(0, &frame->data))
+      {
+        delete frame;
+        return false;
+      }
+    frame->data.resize(seg.hdr_len + seg.payload);
+
+    _frame.reset(frame);
+    _seg = seg;
+    _src = src;
+    _mangle = mangle;
+    _priority = priority;
+    _segments = 1;
+    _next_seq = seg.seq + seg.payload;
+    return true;
+  }
+
+  /**
+   * Append a segment to the merged frame if it continues it.
+   *
+   * \param request  The segment.
+   * \param seg      Header locations of the segment.
+   * \param src      Source port of the segment.
+   *
+   * \retval true   The segment was appended.
+   * \retval false  The segment does not continue the merged frame.
+   */
+  bool append(Virtio_net_request *request, Segment const &seg,
+              void const *src)
+  {
+    auto &data = _frame->data;
+    if (   src != _src || seg.ipv6 != _seg.ipv6 || seg.hdr_len != _seg.hdr_len
+        || seg.l3_off != _seg.l3_off || seg.seq != _next_seq
+        || seg.payload > _seg.payload
+        || data.size() - _seg.l3_off + seg.payload > Max_ip_len
+        || !same_headers(reinterpret_cast<l4_uint8_t const *>(
+                           request->first_buffer().pos)))
+      return false;
+
+    l4_uint32_t size = data.size();
+    if (!request->copy_out(seg.hdr_len, &data))
+      {
+        data.resize(size);
+        return false;
+      }
+    data.resize(size + seg.payload);
+
+    _flags_seen |= seg.flags;
+    _last_payload = seg.payload;
+    _next_seq += seg.payload;
+    ++_segments;
+    return true;
+  }
+
+  /**
+   * Check whether the merged frame must be delivered before further
+   * segments arrive.
+   */
+  bool complete() const
+  {
+    return (_flags_seen & Tcp_psh)
+           || (_segments > 1 && _last_payload < _seg.payload);
+  }
+
+  /**
+   * Finish the merged frame.
+   *
+   * \param[out] mangle    VLAN mangling of the frame.
+   * \param[out] priority  Priority of the frame.
+   *
+   * \return The frame, owned by the caller.
+   */
+  Virtio_net_transfer::Local_frame *finish(Virtio_vlan_mangle *mangle,
+                                           l4_uint8_t *priority)
+  {
+    Virtio_net_transfer::Local_frame *frame = _frame.release();
+    *mangle = _mangle;
+    *priority = _priority;
+    if (_segments > 1)
+      build_tso_header(frame);
+
+    _flags_seen = 0;
+    _last_payload = 0;
+    return frame;
+  }
+
+private:
+  enum : l4_uint32_t
+  {
+    Max_ip_len = 65535,
+    Tcp_psh = 0x08,
+    Tcp_ack = 0x10,
+  };
+
+  /**
+   * Compare the headers of a segment with the merged frame, apart from
+   * the fields that change from segment to segment.
+   */
+  bool same_headers(l4_uint8_t const *p) const
+  {
+    l4_uint8_t const *q = _frame->data.data();
+    l4_uint32_t l3 = _seg.l3_off;
+    l4_uint32_t l4 = _seg.l4_off;
+
+    if (memcmp(p, q, l3))
+      return false;
+
+    if (_seg.ipv6)
+      {
+        // Everything apart from the payload length.
+        if (memcmp(p + l3, q + l3, 4) || memcmp(p + l3 + 6, q + l3 + 6, 34))
+          return false;
+      }
+    else
+      {
+        // Everything apart from the total length, ID and checksum.
+        if (   memcmp(p + l3, q + l3, 2) || memcmp(p + l3 + 6, q + l3 + 6, 4)
+            || memcmp(p + l3 + 12, q + l3 + 12, 8))
+          return false;
+      }
+
+    // Ports, ACK, header length, window, urgent pointer and options; the
+    // flags may only differ in PSH.
+    return    !memcmp(p + l4, q + l4, 4)
+           && !memcmp(p + l4 + 8, q + l4 + 8, 5)
+           && !((p[l4 + 13] ^ q[l4 + 13]) & ~Tcp_psh)
+           && !memcmp(p + l4 + 14, q + l4 + 14, 2)
+           && !memcmp(p + l4 + 18, q + l4 + 18, _seg.hdr_len - l4 - 18);
+  }
+
+  static void put_be16(l4_uint8_t *p, l4_uint32_t value)
+  {
+    p[0] = (value >> 8) & 0xff;
+    p[1] = value & 0xff;
+  }
+
+  /** Turn the merged frame into a TSO packet with a partial checksum. */
+  void build_tso_header(Virtio_net_transfer::Local_frame *frame) const
+  {
+    l4_uint8_t *p = frame->data.data();
+    l4_uint8_t *ip = p + _seg.l3_off;
+    l4_uint8_t *tcp = p + _seg.l4_off;
+    l4_uint32_t tcp_len = frame->data.size() - _seg.l4_off;
+
+    Inet_checksum pseudo;
+    if (_seg.ipv6)
+      {
+        put_be16(ip + 4, tcp_len);
+        pseudo.add(ip + 8, 32);
+      }
+    else
+      {
+        put_be16(ip + 2, frame->data.size() - _seg.l3_off);
+        put_be16(ip + 10, 0);
+        Inet_checksum ip_csum;
+        ip_csum.add(ip, 20);
+        l4_uint16_t result = ip_csum.result();
+        memcpy(ip + 10, &result, sizeof(result));
+        pseudo.add(ip + 12, 8);
+      }
+
+    tcp[13] |= _flags_seen;
+    pseudo.add_u16(6);
+    pseudo.add_u16(tcp_len);
+    // The guest completes the checksum starting from the pseudo header sum.
+    l4_uint16_t seed = ~pseudo.result();
+    memcpy(tcp + 16, &seed, sizeof(seed));
+
+    Virtio_net::Hdr &hdr = frame->hdr;
+    hdr = Virtio_net::Hdr();
+    hdr.flags.need_csum() = true;
+    hdr.gso_type = _seg.ipv6 ? Virtio_net::Hdr::Gso_tcpv6
+                             : Virtio_net::Hdr::Gso_tcpv4;
+    hdr.gso_size = _seg.payload;
+    hdr.hdr_len = _seg.hdr_len;
+    hdr.csum_start = _seg.l4_off;
+    hdr.csum_offset = 16;
+  }
+
+  cxx::unique_ptr<Virtio_net_transfer::Local_frame> _frame;
+  /// Headers of the first segment; its payload is the segment size.
+  Segment _seg;
+  void const *_src = nullptr;
+  Virtio_vlan_mangle _mangle;
+  l4_uint8_t _priority = 0;
+  /// TCP flags of the appended segments.
+  l4_uint8_t _flags_seen = 0;
+  unsigned _segments = 0;
+  l4_uint32_t _last_payload = 0;
+  l4_uint32_t _next_seq = 0;
+};
+/**\}*/
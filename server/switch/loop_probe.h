@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2024 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <l4/sys/types.h>
+#include <l4/util/rdtsc.h>
+
+#include <cstring>
+
+#include "virtio_net_buffer.h"
+
+/**
+ * \ingroup virtio_net_switch
+ * \{
+ */
+
+/**
+ * Probe frame to detect forwarding loops.
+ *
+ * The switch periodically sends a probe to the ports with loop detection.
+ * The probe is a broadcast with the EtherType of the Ethernet configuration
+ * testing protocol (loopback), which guests ignore and bridges forward. It
+ * carries the ID of the switch process, the bridge domain and the port it was
+ * sent to. If a probe of the switch itself comes back on a port of the same
+ * bridge domain, the packets of the switch circulate. Probes of other switch
+ * processes are forwarded like any other broadcast.
+ *
+ * Guests see the probes sent to them. To keep a guest from forging probes
+ * that block other ports, each probe carries a nonce derived from a secret
+ * of the switch, the port and the probe round, see compute_nonce().
+ */
+struct __attribute__((packed)) Loop_probe
+{
+  enum : l4_uint32_t
+  {
+    Ethertype = 0x9000,
+    Magic = 0x4c4f4f50, // "LOOP"
+  };
+
+  l4_uint8_t dst[6];
+  l4_uint8_t src[6];
+  l4_uint8_t ethertype[2];
+  l4_uint32_t magic;
+  l4_uint64_t switch_id;
+  l4_uint32_t bridge;
+  l4_uint32_t port;
+  l4_uint64_t nonce;
+  /// Pads the probe to the minimum Ethernet frame size.
+  l4_uint8_t padding[60 - 42];
+
+  /**
+   * Fill in a probe of this switch.
+   *
+   * \param bridge  Bridge domain of the port.
+   * \param port    Slot of the port in the switch.
+   */
+  void init(unsigned bridge, unsigned port)
+  {
+    memset(this, 0, sizeof(*this));
+    memset(dst, 0xff, sizeof(dst));
+    // Locally administered unicast address derived from the switch ID.
+    l4_uint64_t id = own_id();
+    src[0] = 0x02;
+    memcpy(src + 1, &id, sizeof(src) - 1);
+    ethertype[0] = Ethertype >> 8;
+    ethertype[1] = Ethertype & 0xff;
+    magic = Magic;
+    switch_id = id;
+    this->bridge = bridge;
+    this->port = port;
+  }
+
+  /**
+   * Get the probe contained in a packet.
+   *
+   * \param pkt  First buffer of the packet, positioned at the Ethernet
+   *             header.
+   *
+   * \return The probe if the packet is a probe of this switch process,
+   *         nullptr otherwise.
+   */
+  static Loop_probe const *from_packet(Buffer const &pkt)
+  {
+    if (L4_LIKELY(   !pkt.pos || pkt.left < sizeof(Loop_probe)
+                  || (l4_uint8_t)pkt.pos[12] != (Ethertype >> 8)
+                  || (l4_uint8_t)pkt.pos[13] != (Ethertype & 0xff)))
+      return nullptr;
+
+    auto const *probe = reinterpret_cast<Loop_probe const *>(pkt.pos);
+    if (probe->magic != Magic || probe->switch_id != own_id())
+      return nullptr;
+
+    return probe;
+  }
+
+  /**
+   * Compute the nonce of a probe.
+   *
+   * \param key    Secret key of the switch.
+   * \param port   Slot of the port the probe is sent to.
+   * \param round  Secret of the probe round.
+   *
+   * The nonce is the SipHash-2-4 of port and round, so the nonce of one port
+   * reveals neither the key nor the nonces of other ports or rounds.
+   */
+  static l4_uint64_t compute_nonce(l4_uint64_t const key[2],
+                                   l4_uint64_t port, l4_uint64_t round)
+  {
+    l4_uint64_t v[4] = { key[0] ^ 0x736f6d6570736575ULL,
+                         key[1] ^ 0x646f72616e646f6dULL,
+                         key[0] ^ 0x6c7967656e657261ULL,
+                         key[1] ^ 0x7465646279746573ULL };
+    l4_uint64_t const msg[3] = { port, round, 16ULL << 56 };
+    for (l4_uint64_t m : msg)
+      {
+        v[3] ^= m;
+        sip_round(v);
+        sip_round(v);
+        v[0] ^= m;
+      }
+
+    v[2] ^= 0xff;
+    for (unsigned i = 0; i < 4; ++i)
+      sip_round(v);
+
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+  }
+
+  /** Get the ID of this switch process. */
+  static l4_uint64_t own_id()
+  {
+    static l4_uint64_t id = l4_rdtsc() | 1;
+    return id;
+  }
+
+private:
+  static l4_uint64_t rotl(l4_uint64_t x, unsigned b)
+  { return (x << b) | (x >> (64 - b)); }
+
+  static void sip_round(l4_uint64_t v[4])
+  {
+    v[0] += v[1]; v[1] = rotl(v[1], 13); v[1] ^= v[0]; v[0] = rotl(v[0], 32);
+    v[2] += v[3]; v[3] = rotl(v[3], 16); v[3] ^= v[2];
+    v[0] += v[3]; v[3] = rotl(v[3], 21); v[3] ^= v[0];
+    v[2] += v[1]; v[1] = rotl(v[1], 17); v[1] ^= v[2]; v[2] = rotl(v[2], 32);
+  }
+};
+
+static_assert(sizeof(Loop_probe) == 60, "Loop probe is a minimum size frame");
+
+/**\}*/
@@ -60,6 +60,10 @@ public:
     return _mac & 1;
   }
 
+  /** Get the internal representation of the MAC address. */
+  uint64_t raw() const
+  { return _mac; }
+
   /** Check if the MAC address is not yet known. */
   bool is_unknown() const
   { return _mac == Addr_unknown; }
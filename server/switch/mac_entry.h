@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2024 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <l4/cxx/dlist>
+#include <l4/sys/types.h>
+
+#include "mac_addr.h"
+
+class Virtio_port;
+
+/**
+ * \ingroup virtio_net_switch
+ * \{
+ */
+
+/**
+ * Entry of the MAC table.
+ *
+ * The instances hold the actual key (addr) to know which lookup structure
+ * entry points there. Each entry in use is linked into the list of entries of
+ * its port, so the entries of a port are removed without searching the whole
+ * table.
+ */
+struct Mac_table_entry : public cxx::D_list_item
+{
+  typedef cxx::D_list<Mac_table_entry> List;
+
+  Virtio_port *port;
+  Mac_addr addr;
+  /// Moves to another port since `move_window`.
+  unsigned moves;
+  /// Begin of the one second window counting moves.
+  l4_cpu_time_t move_window;
+  /// End of the dampening interval of a flapping address.
+  l4_cpu_time_t hold_until;
+
+  Mac_table_entry()
+  : port(nullptr),
+    addr(Mac_addr::Addr_unknown),
+    moves(0),
+    move_window(0),
+    hold_until(0)
+  {}
+};
+/**\}*/
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2024 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <l4/re/dataspace>
+#include <l4/re/env>
+#include <l4/re/error_helper>
+#include <l4/re/rm>
+
+#include <cstring>
+
+#include "debug.h"
+#include "mac_addr.h"
+
+/**
+ * \ingroup virtio_net_switch
+ * \{
+ */
+
+/**
+ * Persistent copy of the learned MAC addresses.
+ *
+ * The snapshot lives in a dataspace that is handed to the switch at startup
+ * and that survives a restart of the switch. The switch periodically stores
+ * its MAC table into the snapshot and preloads the table from it on startup.
+ * Entries refer to ports by bridge domain and name since port objects do not
+ * survive a restart.
+ *
+ * The snapshot is only valid if the header carries the magic value. The magic
+ * value is cleared while the snapshot is updated, so an interrupted update
+ * leaves an invalid snapshot behind, which is ignored on the next start.
+ */
+class Mac_snapshot
+{
+public:
+  /** A single learned MAC address. */
+  struct Entry
+  {
+    l4_uint64_t mac;     /**< MAC address in Mac_addr::raw() representation */
+    l4_uint16_t vlan;    /**< VLAN configuration of the port */
+    l4_uint16_t bridge;  /**< Bridge domain of the port */
+    char port_name[20];  /**< Base name of the port, see base_name_len() */
+  };
+
+  /**
+   * Get the length of a port name without the `[n]` suffix.
+   *
+   * create() appends the number of the port to its name, which depends on
+   * the order in which ports are created. Entries refer to ports by the name
+   * given with `name=` only, so they match after a restart regardless of the
+   * order in which the ports reconnect.
+   */
+  static unsigned base_name_len(char const *name)
+  {
+    unsigned len = strnlen(name, sizeof(Entry::port_name));
+    if (!len || name[len - 1] != ']')
+      return len;
+
+    unsigned i = len - 1;
+    while (i > 0 && name[i - 1] >= '0' && name[i - 1] <= '9')
+      --i;
+
+    return i > 0 && i < len - 1 && name[i - 1] == '[' ? i - 1 : len;
+  }
+
+  /**
+   * Check whether an entry refers to a port.
+   *
+   * \param e     The entry.
+   * \param name  Name of the port.
+   *
+   * Ports without a name given with `name=` never match.
+   */
+  static bool matches(Entry const &e, char const *name)
+  {
+    unsigned len = base_name_len(name);
+    return    len && len == base_name_len(e.port_name)
+           && !memcmp(e.port_name, name, len);
+  }
+
+  /**
+   * Attach the snapshot dataspace.
+   *
+   * \param ds  Dataspace capability used to store the snapshot.
+   */
+  explicit Mac_snapshot(L4::Cap<L4Re::Dataspace> ds)
+  {
+    l4_size_t size = ds->size();
+    if (size < sizeof(Header) + sizeof(Entry))
+      throw L4::Runtime_error(-L4_EINVAL, "MAC snapshot dataspace too small");
+
+    L4Re::chksys(L4Re::Env::env()->rm()->attach(&_region, size,
+                                                 L4Re::Rm::F::Search_addr
+                                                 | L4Re::Rm::F::RW,
+                                                 L4::Ipc::make_cap_rw(ds)),
+                 "Attach MAC snapshot dataspace.");
+
+    _max_entries = (size - sizeof(Header)) / sizeof(Entry);
+  }
+
+  /**
+   * Call a function for every entry of a valid snapshot.
+   *
+   * \param fn  Function called with each `Entry` of the snapshot.
+   */
+  template<typename F>
+  void for_each(F &&fn) const
+  {
+    Header const *hdr = header();
+    if (hdr->magic != Magic || hdr->num > _max_entries)
+      return;
+
+    for (unsigned i = 0; i < hdr->num; ++i)
+      fn(entries()[i]);
+  }
+
+  /** Invalidate the snapshot and start storing a new set of entries. */
+  void start()
+  {
+    header()->magic = 0;
+    header()->num = 0;
+  }
+
+  /**
+   * Add an entry to the snapshot.
+   *
+   * \param addr    The learned MAC address.
+   * \param bridge  The bridge domain of the port \a addr was learned on.
+   * \param vlan    The VLAN configuration of the port \a addr was learned on.
+   * \param name    The name of the port \a addr was learned on.
+   *
+   * Entries exceeding the capacity of the dataspace are silently dropped, as
+   * are entries of ports without a name given with `name=`.
+   */
+  void add(Mac_addr addr, l4_uint16_t bridge, l4_uint16_t vlan,
+           char const *name)
+  {
+    Header *hdr = header();
+    unsigned len = base_name_len(name);
+    if (hdr->num >= _max_entries || !len)
+      return;
+
+    Entry *e = &entries()[hdr->num++];
+    e->mac = addr.raw();
+    e->vlan = vlan;
+    e->bridge = bridge;
+    memset(e->port_name, 0, sizeof(e->port_name));
+    memcpy(e->port_name, name,
+           len < sizeof(e->port_name) ? len : sizeof(e->port_name) - 1);
+  }
+
+  /** Mark the snapshot as valid after all entries were added. */
+  void finish()
+  {
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    header()->magic = Magic;
+  }
+
+private:
+  enum : l4_uint32_t { Magic = 0x324d4143 }; // "CAM2"
+
+  struct Header
+  {
+    l4_uint32_t magic;
+    l4_uint32_t num;
+  };
+
+  Header *header() const
+  { return reinterpret_cast<Header *>(_region.get()); }
+
+  Entry *entries() const
+  { return reinterpret_cast<Entry *>(_region.get() + sizeof(Header)); }
+
+  L4Re::Rm::Unique_region<char *> _region;
+  l4_size_t _max_entries;
+};
+/**\}*/
@@ -10,7 +10,10 @@
 #include <array>
 #include <map>
 #include <algorithm>
-#include "mac_addr.h"
+#include <cstring>
+#include <l4/re/env>
+#include <l4/sys/kip>
+#include "mac_entry.h"
 /**
  * \ingroup virtio_net_switch
  * \{
@@ -33,16 +36,33 @@
  * To prevent unbounded grow of the lookup table the number of entries is
  * limited. Replacement is done on a round-robin basis. If the capacity was
  * reached the oldest entry is evicted.
+ *
+ * Most switches only know a handful of MAC addresses. As long as there are
+ * at most `Small_size` entries, the addresses are kept in a dense key array
+ * which is searched linearly, comparing several keys at once. This is
+ * cheaper than walking the tree of the map. The table moves all entries to
+ * the map once the key array overflows and back once the map shrinks to half
+ * the size of the key array.
+ *
+ * An address that moves between ports more often than the flap limit per
+ * second indicates a forwarding loop or a guest bridge reflecting traffic.
+ * Such an address is held on its current port for the dampening interval
+ * instead of flipping with every packet.
  */
-template<std::size_t Size = 1024U>
+template<std::size_t Size = 1024U, std::size_t Small_size = 16U>
 class Mac_table
 {
+  static_assert(Small_size % 4 == 0 && Small_size <= Size,
+                "Key array must consist of complete vectors of 4 keys");
+
 public:
   Mac_table()
   : _mac_table(),
     _entries(),
     _rr_index(0U)
-  {}
+  {
+    std::fill(_small_keys.begin(), _small_keys.end(), No_key);
+  }
 
   /**
    * Find the destination port for a MAC address.
@@ -54,8 +74,31 @@ public:
    */
   Virtio_port *lookup(Mac_addr dst) const
   {
-    auto entry = _mac_table.find(dst);
-    return (entry != _mac_table.end()) ? entry->second->port : nullptr;
+    Entry *entry = find(dst);
+    return entry ? entry->port : nullptr;
+  }
+
+  /** Outcome of learning a source address. */
+  enum class Learn_result
+  {
+    Learned,    ///< The address is associated with the port
+    Refused,    ///< Port security did not permit to learn the address
+    Violation,  ///< The frame violates port security and must be dropped
+    Flap,       ///< The address started flapping, it is held on its port
+    Held,       ///< The address is held on another port due to flapping
+  };
+
+  /**
+   * Configure the dampening of flapping addresses.
+   *
+   * \param limit  Moves per second after which an address is held on its
+   *               port, 0 to disable flap detection.
+   * \param hold   Time in microseconds a flapping address is held.
+   */
+  void set_flap_dampening(unsigned limit, l4_cpu_time_t hold)
+  {
+    _flap_limit = limit;
+    _flap_hold = hold;
   }
 
   /**
@@ -65,46 +108,78 @@ public:
    * \param port  Pointer to the port object that can be used to reach
    *              MAC address src
    *
+   * \return Whether the address was learned, see Learn_result.
+   *
    * Will evict the oldest learned address from the table if the maximum
-   * capacity was reached and if the MAC address was not known yet. The source
-   * port of the table entry is always updated to cope with clients that move
-   * between ports.
+   * capacity was reached and if the MAC address was not known yet. Addresses
+   * of sticky ports are never evicted. The source port of the table entry is
+   * updated to cope with clients that move between ports, unless the address
+   * is bound to a sticky port. The port security of \a port may refuse to
+   * learn new addresses.
    */
-  void learn(Mac_addr src, Virtio_port *port)
+  Learn_result learn(Mac_addr src, Virtio_port *port)
   {
-    Dbg info(Dbg::Port, Dbg::Info);
+    Entry *entry = find(src);
+    if (L4_LIKELY(entry && entry->port == port))
+      return Learn_result::Learned;
 
-    if (L4_UNLIKELY(info.is_active()))
+    // An address bound to a sticky port must not show up on another port.
+    if (entry && entry->port->security().sticky())
+      return Learn_result::Violation;
+
+    if (entry && _flap_limit)
       {
-        // check whether we already know about src mac
-        auto *p = lookup(src);
-        if (!p || p != port)
-          {
-            info.printf("%s %-20s -> ", !p ? "learned " : "replaced",
-                        port->get_name());
-            src.print(info);
-            info.cprintf("\n");
-          }
+        Learn_result res = check_move(entry, port);
+        if (res != Learn_result::Learned)
+          return res;
       }
 
-    auto status = _mac_table.emplace(src, &_entries[_rr_index]);
-    if (L4_UNLIKELY(status.second))
+    Port_security &security = port->security();
+    if (!security.may_learn())
+      return security.sticky() ? Learn_result::Violation
+                               : Learn_result::Refused;
+
+    Dbg info(Dbg::Port, Dbg::Info);
+    if (L4_UNLIKELY(info.is_active()))
       {
-        if (_entries[_rr_index].port)
-          {
-            // remove old entry
-            _mac_table.erase(_entries[_rr_index].addr);
-          }
-        // Set/Replace port and mac address
-        _entries[_rr_index].port = port;
-        _entries[_rr_index].addr = src;
-        _rr_index = (_rr_index + 1U) % Size;
+        info.printf("%s %-20s -> ", !entry ? "learned " : "replaced",
+                    port->get_name());
+        src.print(info);
+        info.cprintf("\n");
       }
-    else
+
+    if (entry)
       {
         // Update port to allow for movement of client between ports
-        status.first->second->port = port;
+        entry->port->security().remove_mac();
+        Entry::List::remove(entry);
+        entry->port = port;
+        port->mac_entries().push_back(entry);
+        security.add_mac();
+        return Learn_result::Learned;
+      }
+
+    entry = next_victim();
+    if (!entry)
+      return Learn_result::Refused;
+
+    if (entry->port)
+      {
+        // remove old entry
+        entry->port->security().remove_mac();
+        Entry::List::remove(entry);
+        erase(entry->addr);
       }
+    // Set/Replace port and mac address
+    entry->port = port;
+    port->mac_entries().push_back(entry);
+    entry->addr = src;
+    entry->moves = 0;
+    entry->move_window = 0;
+    entry->hold_until = 0;
+    insert(src, entry);
+    security.add_mac();
+    return Learn_result::Learned;
   }
 
   /**
@@ -114,49 +189,234 @@ public:
    *
    * This function removes all references to a given port from the MAC
    * table. Since we manage a 1:n association between ports and MAC
-   * addresses there might be more than one entry for a given port and
-   * we have to iterate over the whole array to delete every reference
-   * to the port.
+   * addresses there might be more than one entry for a given port. The port
+   * keeps a list of its entries, so only these entries are visited.
    */
   void flush(Virtio_port *port)
   {
-    typedef std::pair<const Mac_addr, Entry*> TableEntry;
+    auto &entries = port->mac_entries();
+    auto iter = entries.begin();
+    while (iter != entries.end())
+      {
+        Entry *entry = *iter;
+        iter = entries.erase(iter);
+        erase(entry->addr);
+        entry->port = nullptr;
+        entry->addr = Mac_addr(Mac_addr::Addr_unknown);
+      }
+
+    if (_use_map && _mac_table.size() <= Small_size / 2)
+      shrink();
+  }
 
-    auto iter = _mac_table.begin();
-    while ((iter = std::find_if(iter, _mac_table.end(),
-                                [port](TableEntry const &p)
-                                { return p.second->port == port; }))
-           != _mac_table.end())
+  /**
+   * Call a function for every association in the MAC table.
+   *
+   * \param fn  Function called with the MAC address and the port pointer of
+   *            each entry.
+   */
+  template<typename F>
+  void for_each(F &&fn) const
+  {
+    if (!_use_map)
       {
-        iter->second->port = nullptr;
-        iter->second->addr = Mac_addr::Addr_unknown;
-        iter = _mac_table.erase(iter);
+        for (unsigned i = 0; i < _num_small; ++i)
+          fn(_small_entries[i]->addr, _small_entries[i]->port);
+        return;
       }
 
-    assert(std::find_if(_mac_table.begin(), _mac_table.end(),
-                        [port](TableEntry const &p)
-                        { return p.second->port == port; }) == _mac_table.end());
+    for (auto const &e : _mac_table)
+      fn(e.first, e.second->port);
   }
 
 private:
+  typedef Mac_table_entry Entry;
+
   /**
-   * Value class for MAC table entry.
+   * Account a move of an entry to another port.
+   *
+   * \param entry  Entry about to move.
+   * \param port   Port the address showed up on.
    *
-   * The instances hold the actual key (addr) to know which _mac_table entry
-   * points there.
+   * \retval Learn_result::Learned  The entry may move.
+   * \retval Learn_result::Flap     The entry exceeded the flap limit and is
+   *                                held on its port from now on.
+   * \retval Learn_result::Held     The entry is held on its port.
    */
-  struct Entry {
-    Virtio_port *port;
-    Mac_addr addr;
-
-    Entry()
-    : port(nullptr),
-      addr(Mac_addr::Addr_unknown)
-    {}
-  };
+  Learn_result check_move(Entry *entry, Virtio_port *port)
+  {
+    l4_cpu_time_t now = l4_kip_clock(l4re_kip());
+    if (now < entry->hold_until)
+      return Learn_result::Held;
+
+    if (now - entry->move_window >= 1000000)
+      {
+        entry->move_window = now;
+        entry->moves = 0;
+      }
+
+    if (++entry->moves <= _flap_limit)
+      return Learn_result::Learned;
+
+    entry->hold_until = now + _flap_hold;
+    entry->moves = 0;
+
+    Dbg warn(Dbg::Port, Dbg::Warn);
+    if (warn.is_active())
+      {
+        warn.printf("MAC flapping between %s and %s, holding ",
+                    entry->port->get_name(), port->get_name());
+        entry->addr.print(warn);
+        warn.cprintf(" on %s\n", entry->port->get_name());
+      }
+
+    return Learn_result::Flap;
+  }
+
+  /** Key of unused slots of the key array, never a valid 48-bit address. */
+  static constexpr uint64_t No_key = ~0ULL;
+
+  /** Two keys, the smallest vector size of all targets with SIMD units. */
+  typedef uint64_t Key_vec __attribute__((vector_size(16)));
+
+  /**
+   * Find the index of an address in the key array.
+   *
+   * \retval -1     The address is not in the key array.
+   * \retval other  The index of the address.
+   *
+   * Compares four keys per step using vector compares (SSE/AVX2, NEON) or
+   * scalar code on targets without SIMD unit.
+   */
+  int find_small(Mac_addr addr) const
+  {
+    uint64_t key = addr.raw();
+    Key_vec keys = { key, key };
+
+    // Unused slots hold No_key, so we may always compare four keys.
+    for (unsigned i = 0; i < _num_small; i += 4)
+      {
+        Key_vec lo, hi;
+        memcpy(&lo, &_small_keys[i], sizeof(lo));
+        memcpy(&hi, &_small_keys[i + 2], sizeof(hi));
+        Key_vec eq = (lo == keys) | (hi == keys);
+        if (L4_LIKELY(!(eq[0] | eq[1])))
+          continue;
+
+        for (unsigned j = 0; j < 4; ++j)
+          if (_small_keys[i + j] == key)
+            return i + j;
+      }
+
+    return -1;
+  }
+
+  /**
+   * Select the entry for a new address in round-robin order.
+   *
+   * \retval nullptr  All entries belong to sticky ports.
+   * \retval other    A free entry or the oldest entry of a non-sticky port.
+   */
+  Entry *next_victim()
+  {
+    for (std::size_t n = 0; n < Size; ++n)
+      {
+        Entry *entry = &_entries[_rr_index];
+        _rr_index = (_rr_index + 1U) % Size;
+        if (!entry->port || !entry->port->security().sticky())
+          return entry;
+      }
+
+    return nullptr;
+  }
+
+  Entry *find(Mac_addr addr) const
+  {
+    if (L4_LIKELY(!_use_map))
+      {
+        int idx = find_small(addr);
+        return idx >= 0 ? _small_entries[idx] : nullptr;
+      }
+
+    auto entry = _mac_table.find(addr);
+    return (entry != _mac_table.end()) ? entry->second : nullptr;
+  }
+
+  void insert(Mac_addr addr, Entry *entry)
+  {
+    if (_use_map)
+      {
+        _mac_table.emplace(addr, entry);
+        return;
+      }
+
+    if (_num_small < Small_size)
+      {
+        _small_keys[_num_small] = addr.raw();
+        _small_entries[_num_small] = entry;
+        ++_num_small;
+        return;
+      }
+
+    // The key array overflows, move all entries to the map.
+    for (unsigned i = 0; i < _num_small; ++i)
+      _mac_table.emplace(_small_entries[i]->addr, _small_entries[i]);
+    std::fill(_small_keys.begin(), _small_keys.end(), No_key);
+    _num_small = 0;
+    _use_map = true;
+
+    _mac_table.emplace(addr, entry);
+  }
+
+  void erase(Mac_addr addr)
+  {
+    if (_use_map)
+      {
+        _mac_table.erase(addr);
+        return;
+      }
+
+    int idx = find_small(addr);
+    if (idx >= 0)
+      erase_small(idx);
+  }
+
+  void erase_small(unsigned idx)
+  {
+    // Keep the key array dense by moving the last entry into the gap.
+    --_num_small;
+    _small_keys[idx] = _small_keys[_num_small];
+    _small_entries[idx] = _small_entries[_num_small];
+    _small_keys[_num_small] = No_key;
+  }
+
+  /** Move all entries from the map back to the key array. */
+  void shrink()
+  {
+    for (auto const &e : _mac_table)
+      {
+        _small_keys[_num_small] = e.first.raw();
+        _small_entries[_num_small] = e.second;
+        ++_num_small;
+      }
+    _mac_table.clear();
+    _use_map = false;
+  }
 
   std::map<Mac_addr, Entry*> _mac_table;
   std::array<Entry, Size> _entries;
   size_t _rr_index;
+
+  /** Keys of the entries as long as the table is small. */
+  alignas(32) std::array<uint64_t, Small_size> _small_keys;
+  std::array<Entry *, Small_size> _small_entries;
+  unsigned _num_small = 0;
+  /** True if the entries are kept in the map instead of the key array. */
+  bool _use_map = false;
+
+  /** Moves per second after which an address is held, 0 to disable. */
+  unsigned _flap_limit = 0;
+  /** Time in microseconds a flapping address is held on its port. */
+  l4_cpu_time_t _flap_hold = 0;
 };
 /**\}*/
@@ -17,12 +17,16 @@
 #include <l4/sys/cxx/ipc_varg>
 #include <l4/cxx/string>
 
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <terminate_handler-l4>
 
+#include "copy_worker.h"
 #include "debug.h"
+#include "mac_snapshot.h"
 #include "options.h"
+#include "stats.h"
 #include "switch.h"
 #include "vlan.h"
 
@@ -44,6 +48,63 @@
  */
 
 
+using Switch_vector = std::vector<Virtio_switch *>;
+
+/**
+ * Server loop hooks batching the kick IRQs of the switch ports.
+ *
+ * A kick IRQ only queues its port at the switch. As long as ports are
+ * queued, the server polls for further messages without blocking. Once no
+ * message is waiting anymore, or after `Max_batch` kicks, the queued ports of
+ * all bridge domains are handled in one round each.
+ */
+class Switch_loop_hooks : public L4Re::Util::Br_manager_timeout_hooks
+{
+public:
+  /** Set the switches whose ports are handled by the server. */
+  void set_switches(Switch_vector const &switches)
+  { _switches = switches; }
+
+  /** Queue a port after its kick IRQ arrived. */
+  void port_kicked(Virtio_switch *virtio_switch, Virtio_port *port)
+  {
+    virtio_switch->queue_port_irq(port);
+    if (++_num_kicks >= Max_batch)
+      handle_port_irqs();
+  }
+
+  /** Do not block while kicked ports wait for processing. */
+  l4_timeout_t timeout()
+  {
+    if (_num_kicks)
+      return L4_IPC_BOTH_TIMEOUT_0;
+    return Br_manager_timeout_hooks::timeout();
+  }
+
+  /** A receive timeout means all pending kick IRQs were collected. */
+  void error(l4_msgtag_t tag, l4_utcb_t *utcb)
+  {
+    if (_num_kicks && l4_ipc_error(tag, utcb) == L4_IPC_RETIMEOUT)
+      handle_port_irqs();
+    else
+      Br_manager_timeout_hooks::error(tag, utcb);
+  }
+
+private:
+  enum { Max_batch = 32 };  ///< Maximum number of kicks collected in a row
+
+  void handle_port_irqs()
+  {
+    for (auto *virtio_switch : _switches)
+      if (virtio_switch->port_irqs_pending())
+        virtio_switch->handle_port_irqs();
+    _num_kicks = 0;
+  }
+
+  Switch_vector _switches;
+  unsigned _num_kicks = 0;
+};
+
 /*
  * Registry for our server, used to register
  * - factory capability
@@ -51,11 +112,59 @@
  * - virtio host kick irqs
  * - (timeouts for pending transfers (via server_iface))
  */
-static L4Re::Util::Registry_server<L4Re::Util::Br_manager_timeout_hooks> server;
+static L4Re::Util::Registry_server<Switch_loop_hooks> server;
 
 using Ds_vector = std::vector<L4::Cap<L4Re::Dataspace>>;
 static std::shared_ptr<Ds_vector> trusted_dataspaces;
 
+/**
+ * Timeout to periodically send loop probes.
+ *
+ * The timeout is only armed while ports with loop detection exist.
+ */
+class Loop_probe_timeout : public L4::Ipc_svr::Timeout_queue::Timeout
+{
+public:
+  Loop_probe_timeout(Switch_vector const &switches, unsigned interval_ms)
+  : _switches{switches}, _interval{interval_ms * 1000ULL}
+  {}
+
+  /** Start sending probes unless the timeout is armed already. */
+  void arm()
+  {
+    if (_armed)
+      return;
+
+    _armed = true;
+    schedule();
+  }
+
+  void expired() override
+  {
+    bool sent = false;
+    for (auto *virtio_switch : _switches)
+      sent |= virtio_switch->send_loop_probes();
+
+    // Stop once the last port with loop detection is gone.
+    if (sent)
+      schedule();
+    else
+      _armed = false;
+  }
+
+private:
+  /** Arm the timeout for the next probes. */
+  void schedule()
+  { server.add_timeout(this, l4_kip_clock(l4re_kip()) + _interval); }
+
+  Switch_vector _switches;
+  l4_cpu_time_t _interval;
+  bool _armed = false;
+};
+
+/** Loop probe timeout, nullptr if loop detection is disabled. */
+static Loop_probe_timeout *loop_probe_timeout;
+
 static bool
 parse_int_optstring(char const *optstring, int *out)
 {
@@ -98,6 +207,59 @@ parse_int_param(L4::Ipc::Varg const &param, char const *prefix, int *out)
   return true;
 }
 
+/**
+ * Parse a gate control list parameter.
+ *
+ * \param      param   Parameter of the form
+ *                     "gates=<us>:<mask>[,<us>:<mask>...]".
+ * \param[out] gates   Gate control list to fill.
+ *
+ * \retval true   The parameter is a gate control list.
+ * \retval false  The parameter is something else.
+ *
+ * Throws if the list is invalid.
+ */
+static bool
+parse_gate_list(L4::Ipc::Varg const &param, Gate_control *gates)
+{
+  char const *prefix = "gates=";
+  l4_size_t headlen = strlen(prefix);
+
+  if (param.length() < headlen)
+    return false;
+
+  char const *pstr = param.value<char const *>();
+
+  if (strncmp(pstr, prefix, headlen) != 0)
+    return false;
+
+  std::string list(pstr + headlen, param.length() - headlen);
+  char const *str = list.c_str();
+  while (*str)
+    {
+      char *end;
+      unsigned long duration = strtoul(str, &end, 10);
+      if (end == str || *end != ':')
+        break;
+
+      str = end + 1;
+      unsigned long open = strtoul(str, &end, 0);
+      if (end == str || (*end && *end != ',') || open > 0xff
+          || !gates->add(duration, open))
+        break;
+
+      str = *end ? end + 1 : end;
+    }
+
+  if (*str || !gates->active())
+    {
+      Err(Err::Normal).printf("Bad gate control list '%s'.\n", list.c_str());
+      throw L4::Runtime_error(-L4_EINVAL);
+    }
+
+  return true;
+}
+
 /**
  * The IPC interface for creating ports.
  *
@@ -124,8 +286,8 @@ class Switch_factory : public L4::Epiface_t<Switch_factory, L4::Factory>
 
   public:
     Port(unsigned vq_max, unsigned num_ds, char const *name,
-         l4_uint8_t const *mac)
-    : Virtio_port(vq_max, num_ds, name, mac) {}
+         l4_uint8_t const *mac, bool announce)
+    : Virtio_port(vq_max, num_ds, name, mac, announce) {}
 
     /** register the host IRQ and the port itself on the switch's server */
     void register_end_points(L4Re::Util::Object_registry* registry,
@@ -170,11 +332,12 @@ class Switch_factory : public L4::Epiface_t<Switch_factory, L4::Factory>
       /**
        * Callback for the IRQ
        *
-       * This function redirects the call to `Virtio_switch::handle_port_irq`,
-       * since the port cannot finish a transmission on its own.
+       * This function queues the port at the switch, since the port cannot
+       * finish a transmission on its own. The server loop lets the switch
+       * handle all kicked ports once no further IRQ is pending.
        */
       void handle_irq()
-      { _switch->handle_port_irq(_port); }
+      { server.port_kicked(_switch, _port); }
 
       Kick_irq(Virtio_switch *virtio_switch, Virtio_port *port)
       : _switch{virtio_switch}, _port{port} {}
@@ -184,8 +347,9 @@ class Switch_factory : public L4::Epiface_t<Switch_factory, L4::Factory>
   public:
     Switch_port(L4Re::Util::Object_registry* registry,
                 Virtio_switch *virtio_switch, unsigned vq_max, unsigned num_ds,
-                char const *name, l4_uint8_t const *mac)
-    : Port(vq_max, num_ds, name, mac), _kick_irq(virtio_switch, this)
+                char const *name, l4_uint8_t const *mac, bool announce)
+    : Port(vq_max, num_ds, name, mac, announce),
+      _kick_irq(virtio_switch, this)
     { register_end_points(registry, &_kick_irq); }
 
     virtual ~Switch_port()
@@ -222,6 +386,8 @@ class Switch_factory : public L4::Epiface_t<Switch_factory, L4::Factory>
        */
       void handle_irq()
       {
+        _port->handle_ctrl_queue();
+
         do
           {
             _port->tx_q()->disable_notify();
@@ -248,7 +414,7 @@ class Switch_factory : public L4::Epiface_t<Switch_factory, L4::Factory>
     Monitor_port(L4Re::Util::Object_registry* registry,
                  unsigned vq_max, unsigned num_ds, char const *name,
                  l4_uint8_t const *mac)
-    : Port(vq_max, num_ds, name, mac), _kick_irq(this)
+    : Port(vq_max, num_ds, name, mac, false), _kick_irq(this)
     { register_end_points(registry, &_kick_irq); }
 
     virtual ~Monitor_port()
@@ -262,21 +428,25 @@ class Switch_factory : public L4::Epiface_t<Switch_factory, L4::Factory>
   };
 
   /*
-   * Handle vanishing caps by telling the switch that a port might have gone
+   * Handle vanishing caps by telling the switches that a port might have gone
    */
   struct Del_cap_irq : public L4::Irqep_t<Del_cap_irq>
   {
   public:
     void handle_irq()
-    { _switch->check_ports(); }
+    {
+      for (auto *virtio_switch : *_switches)
+        virtio_switch->check_ports();
+    }
 
-    Del_cap_irq(Virtio_switch *virtio_switch) : _switch{virtio_switch} {}
+    Del_cap_irq(Switch_vector const *switches) : _switches{switches} {}
 
   private:
-    Virtio_switch *_switch;
+    Switch_vector const *_switches;
   };
 
-  Virtio_switch *_virtio_switch; /**< pointer to the actual net switch object */
+  /** the net switch objects, one per bridge domain */
+  Switch_vector _switches;
 
   /** maximum number of entries in a new virtqueueue created for a port */
   unsigned _vq_max_num;
@@ -293,12 +463,19 @@ class Switch_factory : public L4::Epiface_t<Switch_factory, L4::Factory>
    *                          present.
    * \param[out] vlan_trunk   List of VLANs if "vlan=trunk=[<id>[,<id]*] is
    *                          present.
+   * \param[out] mac          MAC address if "mac=<mac>" is present.
+   * \param[out] mac_set      Set to true if "mac=<mac>" is present.
+   * \param[out] isolation    Isolation type if "isolation=<type>" is present.
+   * \param[out] community    Community id if "isolation=community=<id>" is
+   *                          present.
    */
   bool handle_opt_arg(L4::Ipc::Varg const &opt, bool &monitor,
                       char *name, size_t size,
                       l4_uint16_t &vlan_access,
                       std::vector<l4_uint16_t> &vlan_trunk,
-                      l4_uint8_t mac[6], bool &mac_set)
+                      l4_uint8_t mac[6], bool &mac_set,
+                      Virtio_port::Isolation &isolation,
+                      l4_uint16_t &community)
   {
     assert(opt.is_of<char const *>());
     unsigned len = opt.length();
@@ -390,6 +567,36 @@ class Switch_factory : public L4::Epiface_t<Switch_factory, L4::Factory>
             err.printf("Invalid mac address '%.*s'\n", len - 4, opt_str + 4);
             return false;
           }
+        else if (!strncmp("isolation=", opt_str, 10))
+          {
+            cxx::String str(opt_str + 10, strnlen(opt_str + 10, len - 10));
+            cxx::String::Index idx;
+
+            if (str == cxx::String("promiscuous"))
+              isolation = Virtio_port::Isolation::Promiscuous;
+            else if (str == cxx::String("isolated"))
+              isolation = Virtio_port::Isolation::Isolated;
+            else if ((idx = str.starts_with("community=")))
+              {
+                str = str.substr(idx);
+                int next = str.from_dec(&community);
+                if (!next || next != str.len() || community == 0)
+                  {
+                    err.printf("Invalid community id '%.*s'\n",
+                               opt.length(), opt.data());
+                    return false;
+                  }
+                isolation = Virtio_port::Isolation::Community;
+              }
+            else
+              {
+                err.printf("Invalid isolation type '%.*s'\n",
+                           opt.length(), opt.data());
+                return false;
+              }
+
+            return true;
+          }
       }
 
     err.printf("Unknown option '%.*s'\n", opt.length(), opt.data());
@@ -397,9 +604,9 @@ class Switch_factory : public L4::Epiface_t<Switch_factory, L4::Factory>
   }
 
 public:
-  Switch_factory(Virtio_switch *virtio_switch, unsigned vq_max_num)
-  : _virtio_switch{virtio_switch}, _vq_max_num{vq_max_num},
-    _del_cap_irq{virtio_switch}
+  Switch_factory(Switch_vector const &switches, unsigned vq_max_num)
+  : _switches{switches}, _vq_max_num{vq_max_num},
+    _del_cap_irq{&_switches}
   {
     auto c = L4Re::chkcap(server.registry()->register_irq_obj(&_del_cap_irq));
     L4Re::chksys(L4Re::Env::env()->main_thread()->register_del_irq(c));
@@ -417,6 +624,13 @@ public:
     Dbg warn(Dbg::Port, Dbg::Warn, "Port");
     Dbg info(Dbg::Port, Dbg::Info, "Port");
 
+    // The statistics dataspace, read-only for clients.
+    if (type == 1)
+      {
+        res = L4::Ipc::make_cap(Statistics::ds(), L4_CAP_FPAGE_RO);
+        return L4_EOK;
+      }
+
     info.printf("Incoming port request\n");
 
     // test for supported object types
@@ -440,6 +654,19 @@ public:
     l4_uint8_t mac[6] = { 0x02, 0x08, 0x0f, 0x2a, 0x00, 0x00 };
     bool mac_set = false;
     int num_ds = 2;
+    auto isolation = Virtio_port::Isolation::Promiscuous;
+    l4_uint16_t community = 0;
+    int cpu = -1;
+    int bridge = 0;
+    int queue_size = _vq_max_num;
+    int mac_limit = 0;
+    int learn_rate = 0;
+    bool mac_sticky = false;
+    Gate_control gates;
+    int egress_rate = 0;
+    int egress_burst = 0;
+    bool loop_detect = false;
+    bool announce = false;
 
     for (L4::Ipc::Varg opt: va)
       {
@@ -460,14 +687,111 @@ public:
             continue;
           }
 
+        if (parse_int_param(opt, "bridge=", &bridge))
+          {
+            if (bridge < 0 || static_cast<unsigned>(bridge) >= _switches.size())
+              {
+                warn.printf("Invalid bridge domain %d, must be less than %zu\n",
+                            bridge, _switches.size());
+                return -L4_EINVAL;
+              }
+            continue;
+          }
+
+        if (parse_int_param(opt, "queue-size=", &queue_size))
+          {
+            // QueueNumMax must be power of 2 not exceeding the global maximum
+            if (queue_size < 1
+                || static_cast<unsigned>(queue_size) > _vq_max_num
+                || (queue_size & (queue_size - 1)))
+              {
+                warn.printf("Invalid queue size %d, must be power of 2 between"
+                            " 1 and %u\n", queue_size, _vq_max_num);
+                return -L4_EINVAL;
+              }
+            continue;
+          }
+
+        if (parse_int_param(opt, "mac-limit=", &mac_limit))
+          {
+            if (mac_limit < 0)
+              {
+                warn.printf("Invalid MAC limit %d\n", mac_limit);
+                return -L4_EINVAL;
+              }
+            continue;
+          }
+
+        if (parse_int_param(opt, "mac-learn-rate=", &learn_rate))
+          {
+            if (learn_rate < 0)
+              {
+                warn.printf("Invalid MAC learn rate %d\n", learn_rate);
+                return -L4_EINVAL;
+              }
+            continue;
+          }
+
+        if (parse_gate_list(opt, &gates))
+          continue;
+
+        if (parse_int_param(opt, "egress-rate=", &egress_rate))
+          {
+            if (egress_rate < 0)
+              {
+                warn.printf("Invalid egress rate %d\n", egress_rate);
+                return -L4_EINVAL;
+              }
+            continue;
+          }
+
+        if (parse_int_param(opt, "egress-burst=", &egress_burst))
+          {
+            if (egress_burst < 0)
+              {
+                warn.printf("Invalid egress burst %d\n", egress_burst);
+                return -L4_EINVAL;
+              }
+            continue;
+          }
+
+        if (!strncmp("mac-sticky", opt.data(), opt.length()))
+          {
+            mac_sticky = true;
+            continue;
+          }
+
+        if (!strncmp("loop-detect", opt.data(), opt.length()))
+          {
+            loop_detect = true;
+            continue;
+          }
+
+        if (!strncmp("announce", opt.data(), opt.length()))
+          {
+            announce = true;
+            continue;
+          }
+
+        if (parse_int_param(opt, "cpu=", &cpu))
+          {
+            if (cpu < 0)
+              {
+                warn.printf("Invalid CPU number %d\n", cpu);
+                return -L4_EINVAL;
+              }
+            continue;
+          }
+
         if (!handle_opt_arg(opt, monitor, name, sizeof(name), vlan_access,
-                            vlan_trunk, mac, mac_set))
+                            vlan_trunk, mac, mac_set, isolation, community))
           return -L4_EINVAL;
 
         ++arg_n;
       }
 
-    int port_num = _virtio_switch->port_available(monitor);
+    Virtio_switch *virtio_switch = _switches[bridge];
+    int port_num = virtio_switch->port_available(monitor);
     if (port_num < 0)
       {
         warn.printf("No port available\n");
@@ -480,6 +804,13 @@ public:
         return -L4_EINVAL;
       }
 
+    if ((vlan_access || !vlan_trunk.empty())
+        && Options::get_options()->wire_mode())
+      {
+        warn.printf("VLAN ports are not supported in wire mode.\n");
+        return -L4_EINVAL;
+      }
+
     if (name[0])
       {
         // append port number
@@ -516,7 +847,7 @@ public:
     Port *port;
     if (monitor)
       {
-        port = new Monitor_port(server.registry(), _vq_max_num, num_ds, name,
+        port = new Monitor_port(server.registry(), queue_size, num_ds, name,
                                 mac_ptr);
         port->set_monitor();
 
@@ -524,16 +855,68 @@ public:
           warn.printf("vlan=access=<id> ignored on monitor ports!\n");
         if (!vlan_trunk.empty())
           warn.printf("vlan=trunk=... ignored on monitor ports!\n");
+        if (isolation != Virtio_port::Isolation::Promiscuous)
+          warn.printf("isolation=... ignored on monitor ports!\n");
+        if (mac_limit || learn_rate || mac_sticky)
+          warn.printf("Port security ignored on monitor ports!\n");
+        if (gates.active())
+          warn.printf("gates=... ignored on monitor ports!\n");
+        if (loop_detect)
+          warn.printf("loop-detect ignored on monitor ports!\n");
+        if (announce)
+          warn.printf("announce ignored on monitor ports!\n");
       }
     else
       {
-        port = new Switch_port(server.registry(), _virtio_switch, _vq_max_num,
-                               num_ds, name, mac_ptr);
+        port = new Switch_port(server.registry(), virtio_switch, queue_size,
+                               num_ds, name, mac_ptr, announce);
 
         if (vlan_access)
           port->set_vlan_access(vlan_access);
         else if (!vlan_trunk.empty())
           port->set_vlan_trunk(vlan_trunk);
+
+        port->set_isolation(isolation, community);
+
+        port->security().set_max_macs(mac_limit);
+        port->security().set_learn_rate(learn_rate);
+        if (mac_sticky)
+          port->security().set_sticky();
+
+        port->gates() = gates;
+
+        if (loop_detect)
+          {
+            if (loop_probe_timeout)
+              port->set_loop_detect();
+            else
+              warn.printf("loop-detect ignored, loop probes are disabled!\n");
+          }
+      }
+
+    if (egress_rate)
+      port->shaper().set_rate(egress_rate * 1000ULL / 8, egress_burst,
+                              l4_kip_clock(l4re_kip()));
+    else if (egress_burst)
+      warn.printf("egress-burst=%d ignored without egress-rate!\n",
+                  egress_burst);
+
+    if (cpu >= 0)
+      {
+        if (Options::get_options()->get_copy_threads())
+          port->set_cpu(cpu);
+        else
+          warn.printf("cpu=%d ignored without copy threads!\n", cpu);
+      }
+
+    if (Options::get_options()->validate_csum())
+      port->set_validate_csum();
+    if (Options::get_options()->uso())
+      port->enable_uso();
+    if (Options::get_options()->gro())
+      {
+        port->enable_gro();
+        port->set_gro();
       }
 
     port->add_trusted_dataspaces(trusted_dataspaces);
@@ -541,20 +924,85 @@ public:
       port->enable_trusted_ds_validation();
 
     // hand port over to the switch
-    bool added = monitor ? _virtio_switch->add_monitor_port(port)
-                         : _virtio_switch->add_port(port);
+    bool added = monitor ? virtio_switch->add_monitor_port(port)
+                         : virtio_switch->add_port(port);
     if (!added)
       {
         delete port;
         return -L4_ENOMEM;
       }
+    if (port->loop_detect())
+      loop_probe_timeout->arm();
+
     res = L4::Ipc::make_cap(port->obj_cap(), L4_CAP_FPAGE_RWSD);
 
-    info.printf("    Created port %s\n", name);
+    info.printf("    Created port %s in bridge domain %d\n", name, bridge);
     return L4_EOK;
   };
 };
 
+/**
+ * Timeout to periodically store the MAC tables of the switches in a snapshot.
+ */
+class Mac_snapshot_timeout : public L4::Ipc_svr::Timeout_queue::Timeout
+{
+public:
+  Mac_snapshot_timeout(Switch_vector const &switches, Mac_snapshot *snapshot,
+                       unsigned interval_ms)
+  : _switches{switches}, _snapshot{snapshot},
+    _interval{interval_ms * 1000ULL}
+  {}
+
+  /** Arm the timeout for the next snapshot. */
+  void schedule()
+  { server.add_timeout(this, l4_kip_clock(l4re_kip()) + _interval); }
+
+  void expired() override
+  {
+    _snapshot->start();
+    for (auto *virtio_switch : _switches)
+      virtio_switch->store_mac_table(_snapshot);
+    _snapshot->finish();
+
+    schedule();
+  }
+
+private:
+  Switch_vector _switches;
+  Mac_snapshot *_snapshot;
+  l4_cpu_time_t _interval;
+};
+
+/**
+ * Timeout to periodically detect ports with stalled receive queues.
+ */
+class Rx_stall_timeout : public L4::Ipc_svr::Timeout_queue::Timeout
+{
+public:
+  Rx_stall_timeout(Switch_vector const &switches, unsigned timeout_ms)
+  : _switches{switches}, _timeout{timeout_ms * 1000ULL},
+    // Check twice per timeout to detect a stall at most 1.5 timeouts late.
+    _interval{std::max<l4_cpu_time_t>(_timeout / 2, 1000)}
+  {}
+
+  /** Arm the timeout for the next check. */
+  void schedule()
+  { server.add_timeout(this, l4_kip_clock(l4re_kip()) + _interval); }
+
+  void expired() override
+  {
+    l4_cpu_time_t now = l4_kip_clock(l4re_kip());
+    for (auto *virtio_switch : _switches)
+      virtio_switch->check_rx_stalls(now, _timeout);
+
+    schedule();
+  }
+
+private:
+  Switch_vector _switches;
+  l4_cpu_time_t _timeout;
+  l4_cpu_time_t _interval;
+};
 
 int main(int argc, char *argv[])
 {
@@ -565,8 +1013,32 @@ int main(int argc, char *argv[])
   if (Dbg(Dbg::Core, Dbg::Warn).is_active())
     printf("Hello from l4virtio switch\n");
 
-  Virtio_switch *virtio_switch = new Virtio_switch(opts->get_max_ports());
-  Switch_factory *factory = new Switch_factory(virtio_switch,
+  Statistics::init();
+
+  Copy_pool *copy_pool = nullptr;
+  if (opts->get_copy_threads())
+    copy_pool = new Copy_pool(opts->get_copy_threads(), opts->get_copy_cpus(),
+                              server.registry());
+
+  // Independent bridge domains share the server thread and the copy threads.
+  Switch_vector switches;
+  for (int i = 0; i < opts->get_bridges(); ++i)
+    {
+      auto *virtio_switch = new Virtio_switch(opts->get_max_ports(), i,
+                                              opts->wire_mode());
+      if (copy_pool)
+        virtio_switch->set_copy_pool(copy_pool);
+      virtio_switch->set_mac_flap_dampening(opts->get_mac_flap_limit(),
+                                            opts->get_mac_flap_hold(),
+                                            opts->mac_flap_block());
+      if (opts->get_loop_probe_interval() && !opts->wire_mode())
+        virtio_switch->set_loop_detection(opts->get_loop_probe_interval());
+      switches.push_back(virtio_switch);
+    }
+
+  server.set_switches(switches);
+
+  Switch_factory *factory = new Switch_factory(switches,
                                                opts->get_virtq_max_num());
   L4::Cap<void> cap = server.registry()->register_obj(factory, "svr");
   if (!cap.is_valid())
@@ -575,19 +1047,54 @@ int main(int argc, char *argv[])
       return 1;
     }
 
+  if (opts->mac_snapshot_ds().is_valid())
+    {
+      auto *snapshot = new Mac_snapshot(opts->mac_snapshot_ds());
+      for (auto *virtio_switch : switches)
+        virtio_switch->preload_mac_table(snapshot);
+
+      auto *timeout =
+        new Mac_snapshot_timeout(switches, snapshot,
+                                 opts->get_mac_snapshot_interval());
+      timeout->schedule();
+    }
+
+  if (opts->get_rx_stall_timeout())
+    {
+      auto *timeout = new Rx_stall_timeout(switches,
+                                           opts->get_rx_stall_timeout());
+      timeout->schedule();
+    }
+
+  if (opts->get_loop_probe_interval() && !opts->wire_mode())
+    loop_probe_timeout =
+      new Loop_probe_timeout(switches, opts->get_loop_probe_interval());
+
   /*
    * server loop will handle 4 types of events
    * - Switch_factory
    *   - factory protocol
    *   - capability deletion
-   *     - delegated to  Virtio_switch::check_ports()
+   *     - delegated to  Virtio_switch::check_ports() of all bridge domains
    * - Switch_factory::Switch_port
    *   - irqs triggered by clients
-   *     - delegated to Virtio_switch::handle_port_irq()
+   *     - queued via Virtio_switch::queue_port_irq() and delegated to
+   *       Virtio_switch::handle_port_irqs() by Switch_loop_hooks
    * - Virtio_net_transfer
    *   - timeouts for pending transfer requests added by
    *     Virtio_port::handle_request() via registered via
    *     L4::Epiface::server_iface()->add_timeout()
+   * - Mac_snapshot_timeout
+   *   - periodic snapshots of the MAC table (optional)
+   * - Rx_stall_timeout
+   *   - periodic detection of stalled receive queues (optional)
+   *     - delegated to Virtio_switch::check_rx_stalls()
+   * - Loop_probe_timeout
+   *   - periodic loop probes to ports with loop detection
+   *     - delegated to Virtio_switch::send_loop_probes()
+   * - Copy_pool
+   *   - completion irqs of copy worker threads (optional)
+   *     - delegated to Copy_pool::process_completions()
    */
   server.loop();
   return 0;
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2024 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <l4/re/dataspace>
+#include <l4/re/env>
+#include <l4/re/rm>
+#include <l4/sys/consts.h>
+
+#include "debug.h"
+
+/**
+ * \ingroup virtio_net_switch
+ * \{
+ */
+
+/**
+ * Mapping of a guest memory region in the address space of the switch.
+ *
+ * The switch copies packets between buffers spread over the dataspaces the
+ * guests registered. Mapped with 4 KiB pages these accesses thrash the TLB
+ * of the switch once many guests exchange packets. A region whose address
+ * in the switch and offset in the dataspace are superpage aligned to each
+ * other can be mapped with superpages instead; for such a region the switch
+ * requests the mappings from the dataspace up front, which lets the
+ * dataspace provider hand out superpages where its memory allows it.
+ */
+class Mem_region_map
+{
+public:
+  /** Check whether an address lies within the region. */
+  bool contains(void const *addr) const
+  {
+    l4_addr_t a = reinterpret_cast<l4_addr_t>(addr);
+    return a >= _start && a - _start < _size;
+  }
+
+  /**
+   * Check whether the region may be mapped with superpages and its
+   * mappings were requested successfully.
+   */
+  bool superpages() const
+  { return _superpages; }
+
+  /**
+   * Set up the mapping of the region containing an address.
+   *
+   * \param addr  Address of guest memory in the switch.
+   * \param name  Name of the port, for diagnostics.
+   *
+   * \retval true   The region was found.
+   * \retval false  The address is not backed by an attached dataspace.
+   */
+  bool map(void const *addr, char const *name)
+  {
+    l4_addr_t start = reinterpret_cast<l4_addr_t>(addr);
+    unsigned long size = 1;
+    L4Re::Rm::Offset offset;
+    L4Re::Rm::Flags flags;
+    L4::Cap<L4Re::Dataspace> ds;
+    if (L4Re::Env::env()->rm()->find(&start, &size, &offset, &flags, &ds) < 0)
+      return false;
+
+    _start = start;
+    _size = size;
+
+    // Superpages need a superpage aligned part of the region whose address
+    // matches the dataspace offset modulo the superpage size.
+    l4_addr_t sp_start = l4_round_size(start, L4_SUPERPAGESHIFT);
+    l4_addr_t sp_end = l4_trunc_size(start + size, L4_SUPERPAGESHIFT);
+    if (   ((start - offset) & (L4_SUPERPAGESIZE - 1))
+        || sp_start >= sp_end)
+      {
+        Dbg(Dbg::Port, Dbg::Info)
+          .printf("%s: guest memory at %lx (size %lx) not superpage "
+                  "aligned, using 4 KiB pages\n", name, start, size);
+        return true;
+      }
+
+    auto rights = (flags & L4Re::Rm::F::W) ? L4Re::Dataspace::F::RW
+                                           : L4Re::Dataspace::F::R;
+    long err = ds->map_region(offset + (sp_start - start), rights,
+                              sp_start, sp_end);
+    if (err < 0)
+      {
+        Dbg(Dbg::Port, Dbg::Info)
+          .printf("%s: mapping guest memory at %lx failed: %ld\n", name,
+                  sp_start, err);
+        return true;
+      }
+
+    // Whether the provider used superpages depends on its memory.
+    _superpages = true;
+    return true;
+  }
+
+private:
+  l4_addr_t _start = 0;
+  unsigned long _size = 0;
+  bool _superpages = false;
+};
+/**\}*/
@@ -51,6 +51,32 @@ verbosity_mask_from_string(char const *str, unsigned *mask)
   return -L4_ENOENT;
 }
 
+/**
+ * Parse a comma separated list of CPU numbers.
+ *
+ * \param      str   List of CPU numbers, e.g. "0,2,3".
+ * \param[out] cpus  The parsed CPU numbers in order.
+ *
+ * \retval 0          The list was parsed successfully.
+ * \retval -L4_EINVAL The list contains an invalid entry.
+ */
+static int
+parse_cpu_list(char const *str, std::vector<unsigned> *cpus)
+{
+  while (*str)
+    {
+      char *end;
+      unsigned long cpu = strtoul(str, &end, 10);
+      if (end == str || (*end && *end != ',') || cpu >= 1024)
+        return -L4_EINVAL;
+
+      cpus->push_back(cpu);
+      str = *end ? end + 1 : end;
+    }
+
+  return cpus->empty() ? -L4_EINVAL : 0;
+}
+
 /**
  * Set debug level according to a verbosity string.
  *
@@ -123,6 +149,20 @@ Options::parse_cmd_line(int argc, char **argv,
       {"verbose",     0, 0, 'v' },
       {"quiet",       0, 0, 'q' },
       {"register-ds", 1, 0, 'd' }, // register a trusted dataspace
+      {"wire",        0, 0, 'w' }, // point-to-point mode for two ports
+      {"mac-snapshot", 1, 0, 'M' }, // dataspace to persist the MAC table
+      {"mac-snapshot-interval", 1, 0, 'i' }, // MAC snapshot interval in ms
+      {"copy-threads", 1, 0, 'c' }, // number of copy worker threads
+      {"copy-cpus",   1, 0, 'a' }, // CPU affinity of the copy worker threads
+      {"bridges",     1, 0, 'b' }, // number of bridge domains
+      {"rx-stall-timeout", 1, 0, 'S' }, // quarantine stalled ports after ms
+      {"mac-flap-limit", 1, 0, 'f' }, // MAC moves per second before dampening
+      {"mac-flap-hold", 1, 0, 'F' }, // MAC flap dampening interval in ms
+      {"mac-flap-block", 0, 0, 'B' }, // block ports causing MAC flaps
+      {"loop-probe-interval", 1, 0, 'L' }, // loop probe interval in ms
+      {"validate-csum", 0, 0, 'C' }, // verify checksums for the receivers
+      {"uso",         0, 0, 'U' }, // offer checksum and UDP segmentation offload
+      {"gro",         0, 0, 'G' }, // merge TCP segments for the receivers
       {0, 0, 0, 0}
     };
 
@@ -136,7 +176,8 @@ Options::parse_cmd_line(int argc, char **argv,
     info.printf("\t%s\n", argv[i]);
 
   Dbg::set_verbosity(verbosity);
-  while ( (opt = getopt_long(argc, argv, "s:p:mqvD:d:", options, &index)) != -1)
+  while ( (opt = getopt_long(argc, argv, "s:p:mqvD:d:wM:i:c:a:b:S:f:F:BL:CUG",
+                             options, &index)) != -1)
     {
       switch (opt)
         {
@@ -181,11 +222,136 @@ Options::parse_cmd_line(int argc, char **argv,
             trusted_dataspaces->push_back(ds);
             break;
           }
+        case 'w':
+          info.printf("Point-to-point wire mode\n");
+          _wire_mode = true;
+          break;
+        case 'M':
+          _mac_snapshot_ds =
+            L4Re::chkcap(L4Re::Env::env()->get_cap<L4Re::Dataspace>(optarg),
+                         "Find MAC snapshot dataspace capability.\n");
+          info.printf("Persisting MAC table in '%s'\n", optarg);
+          break;
+        case 'i':
+          _mac_snapshot_interval = atoi(optarg);
+          if (_mac_snapshot_interval <= 0)
+            {
+              info.printf("MAC snapshot interval must be positive. Invalid"
+                          " value: %i\n", _mac_snapshot_interval);
+              return -1;
+            }
+          info.printf("MAC snapshot interval: %i ms\n", _mac_snapshot_interval);
+          break;
+        case 'c':
+          _copy_threads = atoi(optarg);
+          if (_copy_threads < 0 || _copy_threads > 64)
+            {
+              info.printf("Number of copy threads must be between 0 and 64."
+                          " Invalid value: %i\n", _copy_threads);
+              return -1;
+            }
+          info.printf("Number of copy threads: %i\n", _copy_threads);
+          break;
+        case 'a':
+          _copy_cpus.clear();
+          if (   parse_cpu_list(optarg, &_copy_cpus) < 0
+              || _copy_cpus.size() > 64)
+            {
+              info.printf("Invalid list of copy thread CPUs: '%s'\n", optarg);
+              return -1;
+            }
+          info.printf("Copy thread CPUs: %s\n", optarg);
+          break;
+        case 'b':
+          _bridges = atoi(optarg);
+          if (_bridges < 1 || _bridges > 64)
+            {
+              info.printf("Number of bridge domains must be between 1 and 64."
+                          " Invalid value: %i\n", _bridges);
+              return -1;
+            }
+          info.printf("Number of bridge domains: %i\n", _bridges);
+          break;
+        case 'S':
+          _rx_stall_timeout = atoi(optarg);
+          if (_rx_stall_timeout < 0)
+            {
+              info.printf("RX stall timeout must not be negative. Invalid"
+                          " value: %i\n", _rx_stall_timeout);
+              return -1;
+            }
+          info.printf("RX stall timeout: %i ms\n", _rx_stall_timeout);
+          break;
+        case 'f':
+          _mac_flap_limit = atoi(optarg);
+          if (_mac_flap_limit < 0)
+            {
+              info.printf("MAC flap limit must not be negative. Invalid"
+                          " value: %i\n", _mac_flap_limit);
+              return -1;
+            }
+          info.printf("MAC flap limit: %i moves/s\n", _mac_flap_limit);
+          break;
+        case 'F':
+          _mac_flap_hold = atoi(optarg);
+          if (_mac_flap_hold <= 0)
+            {
+              info.printf("MAC flap hold time must be positive. Invalid"
+                          " value: %i\n", _mac_flap_hold);
+              return -1;
+            }
+          info.printf("MAC flap hold time: %i ms\n", _mac_flap_hold);
+          break;
+        case 'B':
+          info.printf("Blocking ports causing MAC flaps\n");
+          _mac_flap_block = true;
+          break;
+        case 'L':
+          _loop_probe_interval = atoi(optarg);
+          if (_loop_probe_interval < 0)
+            {
+              info.printf("Loop probe interval must not be negative. Invalid"
+                          " value: %i\n", _loop_probe_interval);
+              return -1;
+            }
+          info.printf("Loop probe interval: %i ms\n", _loop_probe_interval);
+          break;
+        case 'C':
+          info.printf("Verifying checksums for the receivers\n");
+          _validate_csum = true;
+          break;
+        case 'U':
+          info.printf("Offering checksum and UDP segmentation offload\n");
+          _uso = true;
+          break;
+        case 'G':
+          info.printf("Merging TCP segments for the receivers\n");
+          _gro = true;
+          break;
         default:
           Err().printf("Unknown command line option '%c' (%d)\n", opt, opt);
           return -1;
         }
     }
+
+  if (_wire_mode && _max_ports != 2)
+    {
+      info.printf("Wire mode connects exactly two ports, ignoring max number"
+                  " of ports: %i\n", _max_ports);
+      _max_ports = 2;
+    }
+
+  // Start one copy thread per listed CPU if the number was not given.
+  if (!_copy_threads)
+    _copy_threads = _copy_cpus.size();
+
+  if (_copy_cpus.size() > static_cast<unsigned>(_copy_threads))
+    {
+      info.printf("More copy thread CPUs than copy threads: %zu > %i\n",
+                  _copy_cpus.size(), _copy_threads);
+      return -1;
+    }
+
   return 0;
 }
 
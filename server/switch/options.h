@@ -32,6 +32,48 @@ public:
   int assign_mac() const
   { return _assign_mac; }
 
+  bool wire_mode() const
+  { return _wire_mode; }
+
+  L4::Cap<L4Re::Dataspace> mac_snapshot_ds() const
+  { return _mac_snapshot_ds; }
+
+  int get_mac_snapshot_interval() const
+  { return _mac_snapshot_interval; }
+
+  int get_copy_threads() const
+  { return _copy_threads; }
+
+  std::vector<unsigned> const &get_copy_cpus() const
+  { return _copy_cpus; }
+
+  int get_bridges() const
+  { return _bridges; }
+
+  int get_rx_stall_timeout() const
+  { return _rx_stall_timeout; }
+
+  int get_mac_flap_limit() const
+  { return _mac_flap_limit; }
+
+  int get_mac_flap_hold() const
+  { return _mac_flap_hold; }
+
+  bool mac_flap_block() const
+  { return _mac_flap_block; }
+
+  int get_loop_probe_interval() const
+  { return _loop_probe_interval; }
+
+  bool validate_csum() const
+  { return _validate_csum; }
+
+  bool uso() const
+  { return _uso; }
+
+  bool gro() const
+  { return _gro; }
+
   static Options const *
   parse_options(int argc, char **argv,
                 std::shared_ptr<Ds_vector> trusted_dataspaces);
@@ -43,6 +85,20 @@ private:
   int _portq_max_num = 50;    // default value for port queues
   int _request_timeout = 1 * 1000 * 1000; // default packet timeout 1 second
   bool _assign_mac = false;
+  bool _wire_mode = false;
+  L4::Cap<L4Re::Dataspace> _mac_snapshot_ds = L4::Cap_base::Invalid;
+  int _mac_snapshot_interval = 1000; // default snapshot interval 1 second
+  int _copy_threads = 0;   // copy packets in the server thread by default
+  std::vector<unsigned> _copy_cpus; // CPUs of the copy threads, in order
+  int _bridges = 1;        // number of independent bridge domains
+  int _rx_stall_timeout = 0; // RX stall detection disabled by default
+  int _mac_flap_limit = 0;   // MAC moves per second considered a flap, 0 off
+  int _mac_flap_hold = 1000; // dampening interval in ms
+  bool _mac_flap_block = false; // block the port a MAC flapped to
+  int _loop_probe_interval = 1000; // loop probe interval in ms
+  bool _validate_csum = false; // verify checksums for the receivers
+  bool _uso = false;           // offer checksum and UDP segmentation offload
+  bool _gro = false;           // merge TCP segments for the receivers
 
   int parse_cmd_line(int argc, char **argv,
                      std::shared_ptr<Ds_vector> trusted_dataspaces);
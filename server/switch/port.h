@@ -11,7 +11,16 @@
 #include "virtio_net.h"
 #include "request.h"
 #include "transfer.h"
+#include "copy_worker.h"
+#include "egress_shaper.h"
+#include "gate_control.h"
+#include "gro.h"
+#include "loop_probe.h"
 #include "mac_addr.h"
+#include "mac_entry.h"
+#include "mem_map.h"
+#include "port_security.h"
+#include "stats.h"
 #include "vlan.h"
 
 #include <l4/cxx/unique_ptr>
@@ -53,11 +62,66 @@ class Virtio_port : public Virtio_net
   inline l4_uint32_t vlan_bloom_hash(l4_uint16_t vid)
   { return 1UL << (vid & 31U); }
 
+public:
+  /**
+   * Isolation type of a port (private VLAN).
+   *
+   * Promiscuous ports may reach all ports. Isolated ports may only reach
+   * promiscuous ports. Community ports may reach promiscuous ports and ports
+   * of the same community.
+   */
+  enum class Isolation
+  {
+    Promiscuous,
+    Isolated,
+    Community,
+  };
+
+private:
+  Isolation _isolation = Isolation::Promiscuous;
+  l4_uint16_t _community = 0;
+
+  /*
+   * Ports that may receive flooded packets from this port. Maintained by the
+   * switch according to the isolation type of all ports.
+   */
+  std::vector<Virtio_port *> _flood_set;
+
   /*
    * List of pending requests
    */
   Virtio_net_transfer::Pending_list _pending_requests;
 
+  /**
+   * Timeout releasing held transfers when the gates of the port change or
+   * the shaper of the port has tokens again.
+   */
+  struct Hold_timeout : public L4::Ipc_svr::Timeout_queue::Timeout
+  {
+    Virtio_port *port;
+
+    explicit Hold_timeout(Virtio_port *p) : port{p} {}
+
+    void expired() override
+    {
+      port->_hold_timeout_at = 0;
+      port->release_held_requests(l4_kip_clock(l4re_kip()));
+    }
+  };
+
+  /** Gate control list of the port as egress port. */
+  Gate_control _gates;
+  /** Rate limit of the port as egress port. */
+  Egress_shaper _shaper;
+  /**
+   * Transfers held because the gate of their traffic class is closed or the
+   * shaper has no tokens left.
+   */
+  Virtio_net_transfer::Pending_list _held_requests;
+  Hold_timeout _hold_timeout{this};
+  /** Expiry of the hold timeout, 0 if not armed. */
+  l4_cpu_time_t _hold_timeout_at = 0;
+
   void dump_pending_requests()
   {
     Dbg trace(Dbg::Queue, Dbg::Trace, "REQ");
@@ -73,6 +137,57 @@ class Virtio_port : public Virtio_net
   Mac_addr _mac;  /**< The MAC address of the port. */
   char _name[20]; /**< Debug name */
 
+  /** Copy jobs for the receive queue, nullptr if not pipelined. */
+  Copy_queue *_copy_queue = nullptr;
+  /** CPU preferred for copying to the port, Copy_queue::No_cpu if none. */
+  unsigned _cpu = Copy_queue::No_cpu;
+
+  /** Statistics of the port, `_local_stats` if the dataspace is full. */
+  Port_statistics *_stats = &_local_stats;
+  Port_statistics _local_stats = {};
+
+  /*
+   * RX stall detection. The receive queue stalls if requests are pending
+   * while the guest does not add any buffers to it.
+   */
+  bool _rx_quarantined = false;
+  l4_uint16_t _rx_avail_seen = 0;  ///< Avail index at the last check
+  l4_cpu_time_t _rx_stall_start = 0; ///< Begin of the current stall
+
+  /** Restrictions for learning MAC addresses on the port. */
+  Port_security _security;
+  /** MAC table entries of the addresses learned on the port. */
+  Mac_table_entry::List _mac_entries;
+
+  /** End of the TX block of the port after a MAC flap, 0 if not blocked. */
+  l4_cpu_time_t _tx_blocked_until = 0;
+
+  /** Kick IRQ received, port waits for the next processing round. */
+  bool _irq_pending = false;
+
+  /** Verify checksums of packets for the guest, see set_validate_csum(). */
+  bool _validate_csum = false;
+
+  /** Send loop probes to the port. */
+  bool _loop_detect = false;
+  /** End of the block of the port after a loop, 0 if not blocked. */
+  l4_cpu_time_t _loop_blocked_until = 0;
+  /** Probe sent to the port, initialized by the first send_loop_probe(). */
+  struct
+  {
+    Virtio_net::Hdr hdr;
+    Loop_probe frame;
+  } _loop_probe = {};
+
+  /** Merge TCP segments for the guest, see set_gro(). */
+  bool _gro_enabled = false;
+  Tcp_gro _gro;
+
+  /** Guest memory regions of the port mapped so far, see map_guest_mem(). */
+  std::vector<Mem_region_map> _mem_maps;
+  /** Maximum number of dataspaces the guest may register. */
+  unsigned _num_ds;
+
 public:
   // delete copy and assignment
   Virtio_port(Virtio_port const &) = delete;
@@ -167,6 +282,71 @@ public:
     return _vlan_ids.find(id) != _vlan_ids.end();
   }
 
+  /**
+   * Set the isolation type of the port.
+   *
+   * \param isolation  The isolation type.
+   * \param community  Community id if \a isolation is Isolation::Community.
+   */
+  void set_isolation(Isolation isolation, l4_uint16_t community = 0)
+  {
+    _isolation = isolation;
+    _community = isolation == Isolation::Community ? community : 0;
+  }
+
+  /**
+   * Check whether the isolation type permits traffic to another port.
+   *
+   * \param dst  The destination port.
+   *
+   * The relation is symmetric, i.e. traffic is either permitted in both
+   * directions or in none.
+   */
+  bool may_reach(Virtio_port const *dst) const
+  {
+    if (   _isolation == Isolation::Promiscuous
+        || dst->_isolation == Isolation::Promiscuous)
+      return true;
+
+    return    _isolation == Isolation::Community
+           && dst->_isolation == Isolation::Community
+           && _community == dst->_community;
+  }
+
+  /** Get the ports that may receive flooded packets from this port. */
+  std::vector<Virtio_port *> const &flood_set() const
+  { return _flood_set; }
+
+  /** Get the ports that may receive flooded packets from this port. */
+  std::vector<Virtio_port *> &flood_set()
+  { return _flood_set; }
+
+  /**
+   * Hand the copy operations to this port to the copy worker threads.
+   *
+   * \param queue  The copy queue for the receive queue of the port.
+   */
+  void set_copy_queue(Copy_queue *queue)
+  { _copy_queue = queue; }
+
+  /**
+   * Prefer a CPU for copying packets to this port.
+   *
+   * \param cpu  CPU the guest consuming the receive queue runs on.
+   *
+   * Must be called before the port is added to the switch.
+   */
+  void set_cpu(unsigned cpu)
+  { _cpu = cpu; }
+
+  /** Get the preferred CPU of the port, Copy_queue::No_cpu if none. */
+  unsigned cpu() const
+  { return _cpu; }
+
+  /** Get the copy queue of the port, nullptr if not pipelined. */
+  Copy_queue *copy_queue() const
+  { return _copy_queue; }
+
   /**
    * Get MAC address.
    *
@@ -179,16 +359,20 @@ public:
   /**
    * Create a Virtio net port object
    */
-  explicit Virtio_port(unsigned vq_max, unsigned num_ds, char const *name,
-                       l4_uint8_t const *mac)
-  : Virtio_net(vq_max),
-    _mac(Mac_addr::Addr_unknown)
+  Virtio_port(unsigned vq_max, unsigned num_ds, char const *name,
+              l4_uint8_t const *mac, bool announce)
+  : Virtio_net(vq_max, announce),
+    _mac(Mac_addr::Addr_unknown),
+    _num_ds(num_ds)
   {
     init_mem_info(num_ds);
 
     strncpy(_name, name, sizeof(_name));
     _name[sizeof(_name) - 1] = '\0';
 
+    if (auto *stats = Statistics::alloc_port(_name))
+      _stats = stats;
+
     Features hf = _dev_config.host_features(0);
     if (mac)
       {
@@ -218,11 +402,258 @@ public:
         iter = _pending_requests.erase(iter);
         delete i;
       }
+
+    iter = _held_requests.begin();
+    while (iter != _held_requests.end())
+      {
+        auto i = *iter;
+        iter = _held_requests.erase(iter);
+        delete i;
+      }
+
+    if (_hold_timeout_at)
+      server_iface()->remove_timeout(&_hold_timeout);
+
+    if (_stats != &_local_stats)
+      Statistics::free_port(_stats);
+  }
+
+  /** Get the statistics of the port. */
+  Port_statistics *stats() const
+  { return _stats; }
+
+  /** Get the MAC table entries of the port (MAC table only). */
+  Mac_table_entry::List &mac_entries()
+  { return _mac_entries; }
+
+  /** Get the port security settings of the port. */
+  Port_security &security()
+  { return _security; }
+
+  /**
+   * Drop all packets the port sends until a given time.
+   *
+   * \param until  End of the block in microseconds (KIP clock).
+   */
+  void block_tx(l4_cpu_time_t until)
+  { _tx_blocked_until = until; }
+
+  /** Check whether packets sent by the port are dropped. */
+  bool tx_blocked()
+  {
+    if (L4_LIKELY(!_tx_blocked_until))
+      return false;
+
+    if (l4_kip_clock(l4re_kip()) < _tx_blocked_until)
+      return true;
+
+    _tx_blocked_until = 0;
+    return false;
+  }
+
+  /**
+   * Let the switch verify the TCP/UDP checksums of fully checksummed packets
+   * to the port.
+   *
+   * If the guest negotiated VIRTIO_NET_F_GUEST_CSUM, valid packets are
+   * delivered with the data_valid flag, so the guest does not verify them
+   * again. Each packet is verified at most once for all its destinations.
+   */
+  void set_validate_csum()
+  { _validate_csum = true; }
+
+  /**
+   * Let the switch merge TCP segments to the port into large packets.
+   *
+   * Segments are only merged for a guest that negotiated
+   * VIRTIO_NET_F_GUEST_TSO4/6 and VIRTIO_NET_F_GUEST_CSUM, see
+   * Virtio_net::enable_gro().
+   */
+  void set_gro()
+  { _gro_enabled = true; }
+
+  /** Enable sending loop probes to the port. */
+  void set_loop_detect()
+  { _loop_detect = true; }
+
+  /** Check whether loop probes are sent to the port. */
+  bool loop_detect() const
+  { return _loop_detect; }
+
+  /**
+   * Send a loop probe to the guest of the port.
+   *
+   * \param bridge  Bridge domain of the port.
+   * \param slot    Slot of the port in its switch.
+   * \param nonce   Nonce of the probe for the current round.
+   *
+   * The probe bypasses a loop block of the port, so a loop is detected
+   * again while the port is blocked.
+   */
+  void send_loop_probe(unsigned bridge, unsigned slot, l4_uint64_t nonce)
+  {
+    if (!rx_q()->ready())
+      return;
+
+    // Pending probes refer to the frame and are sent with the current nonce.
+    if (_loop_probe.frame.magic != Loop_probe::Magic)
+      _loop_probe.frame.init(bridge, slot);
+    _loop_probe.frame.nonce = nonce;
+
+    Virtio_net_transfer *transfer;
+    if (_copy_queue)
+      transfer = new Worker_transfer(nullptr, &_loop_probe.hdr,
+                                     Buffer(&_loop_probe.frame), this, rx_q(),
+                                     Virtio_vlan_mangle(), _copy_queue);
+    else
+      transfer = new Virtio_net_transfer(nullptr, &_loop_probe.hdr,
+                                         Buffer(&_loop_probe.frame), this,
+                                         rx_q(), _stats,
+                                         Virtio_vlan_mangle());
+
+    send_transfer(transfer);
+  }
+
+  /**
+   * Drop all packets from and to the port until a given time.
+   *
+   * \param until  End of the block in microseconds (KIP clock).
+   */
+  void block_loop(l4_cpu_time_t until)
+  { _loop_blocked_until = until; }
+
+  /** Check whether the port is blocked because of a loop. */
+  bool loop_blocked()
+  {
+    if (L4_LIKELY(!_loop_blocked_until))
+      return false;
+
+    if (l4_kip_clock(l4re_kip()) < _loop_blocked_until)
+      return true;
+
+    Dbg(Dbg::Port, Dbg::Warn)
+      .printf("%s: Unblocking port, loop no longer detected\n", _name);
+    _loop_blocked_until = 0;
+    return false;
+  }
+
+  /** Check whether a kick IRQ of the port awaits processing. */
+  bool irq_pending() const
+  { return _irq_pending; }
+
+  /** Mark that a kick IRQ of the port awaits processing (server thread). */
+  void set_irq_pending(bool pending)
+  { _irq_pending = pending; }
+
+  /** Check whether the receive queue of the port is quarantined. */
+  bool rx_quarantined() const
+  { return _rx_quarantined; }
+
+  /**
+   * Update the RX stall state of the port.
+   *
+   * \param now      Current time in microseconds (KIP clock).
+   * \param timeout  Time in microseconds requests may be pending without the
+   *                 guest adding buffers to the receive queue.
+   *
+   * \retval true   The port entered or left quarantine.
+   * \retval false  The quarantine state did not change.
+   *
+   * A quarantined port drops all packets destined to it instead of letting
+   * them wait for the full request timeout. The port leaves quarantine as
+   * soon as the guest adds buffers to its receive queue.
+   */
+  bool check_rx_stall(l4_cpu_time_t now, l4_cpu_time_t timeout)
+  {
+    if (L4_LIKELY(rx_q()->ready()))
+      {
+        l4_uint16_t idx = rx_q()->avail_idx();
+        if (idx != _rx_avail_seen)
+          {
+            _rx_avail_seen = idx;
+            _rx_stall_start = now;
+            if (!_rx_quarantined)
+              return false;
+
+            _rx_quarantined = false;
+            _stats->flags &= ~Port_statistics::Rx_quarantined;
+            Dbg(Dbg::Port, Dbg::Info)
+              .printf("%s: receive queue refilled, leaving quarantine\n",
+                      get_name());
+            return true;
+          }
+      }
+
+    if (   _rx_quarantined || _pending_requests.empty()
+        || now - _rx_stall_start < timeout)
+      return false;
+
+    _rx_quarantined = true;
+    _stats->flags |= Port_statistics::Rx_quarantined;
+    ++_stats->quarantines;
+    Dbg(Dbg::Port, Dbg::Warn)
+      .printf("%s: receive queue stalled, quarantining port\n", get_name());
+
+    while (!_pending_requests.empty())
+      {
+        auto *transfer = *_pending_requests.begin();
+        _pending_requests.erase(_pending_requests.begin());
+        server_iface()->remove_timeout(transfer);
+        drop_transfer(transfer);
+      }
+
+    return true;
+  }
+
+  void reset() override
+  {
+    // The copy worker must not access the queues while they are reset.
+    if (_copy_queue)
+      _copy_queue->drain();
+
+    Virtio_net::reset();
+    // The guest registers its memory again.
+    _mem_maps.clear();
+  }
+
+  /**
+   * Set up the mapping of the guest memory region containing an address
+   * on first use, see Mem_region_map.
+   *
+   * The switch sees guest memory through the buffers of transmitted packets
+   * and the receive buffers it copied packets to.
+   */
+  void map_guest_mem(void const *addr)
+  {
+    if (!addr)
+      return;
+
+    for (Mem_region_map const &m : _mem_maps)
+      if (m.contains(addr))
+        return;
+
+    if (_mem_maps.size() >= _num_ds)
+      return;
+
+    Mem_region_map m;
+    if (!m.map(addr, _name))
+      return;
+
+    _mem_maps.push_back(m);
+    ++_stats->mem_regions;
+    if (m.superpages())
+      ++_stats->mem_superpage_regions;
   }
 
   /** Check whether there is any work pending on the receive queue */
   bool rx_work_pending() const
   {
+    // The receive queue state belongs to the copy worker, it decides whether
+    // there is space for pending requests.
+    if (_copy_queue)
+      return    !_pending_requests.empty() && _copy_queue->can_submit()
+             && _copy_queue->can_resume();
+
     return L4_LIKELY(rx_q()->ready()) && !_pending_requests.empty()
            && rx_q()->desc_avail();
   }
@@ -237,6 +668,8 @@ public:
   Virtio_net_request::Request_ptr get_tx_request()
   {
     auto ret = Virtio_net_request::get_request(this, tx_q());
+    if (ret)
+      map_guest_mem(ret->first_buffer().pos);
 
     /*
      * Trunk ports are required to have a VLAN tag and only accept packets that
@@ -280,6 +713,15 @@ public:
    */
   void handle_rx_queue()
   {
+    if (L4_UNLIKELY(!_held_requests.empty()))
+      release_held_requests(l4_kip_clock(l4re_kip()));
+
+    if (_copy_queue)
+      {
+        resubmit_pending_requests();
+        return;
+      }
+
     auto iter = _pending_requests.begin();
     while (iter != _pending_requests.end())
       {
@@ -295,6 +737,7 @@ public:
             break;
           }
 
+        map_guest_mem(transfer_ptr->dst_buffer());
         Dbg(Dbg::Queue, Dbg::Trace).printf("\t%s: Removing %p\n", get_name(),
                                            transfer_ptr.get());
         // erase() moves the iterator to the next element of the
@@ -318,6 +761,18 @@ public:
   void handle_request(Virtio_port *src_port,
                       Virtio_net_request::Request_ptr &request)
   {
+    if (L4_UNLIKELY(_rx_quarantined))
+      {
+        ++_stats->quarantine_drops;
+        return;
+      }
+
+    if (L4_UNLIKELY(loop_blocked()))
+      {
+        ++_stats->loop_drops;
+        return;
+      }
+
     Virtio_vlan_mangle mangle;
 
     if (is_trunk())
@@ -340,13 +795,366 @@ public:
       if (src_port->is_trunk())
         mangle = Virtio_vlan_mangle::remove();
 
-    auto transfer_ptr =
-      cxx::make_unique<Virtio_net_transfer>(request, this, rx_q(), mangle);
+    if (L4_UNLIKELY(_gro_enabled) && gro_receive(src_port, request, mangle))
+      return;
+
+    Virtio_net::Hdr const *hdr = request->header();
+    if (L4_UNLIKELY(   hdr->flags.need_csum()
+                    || hdr->gso_type != Virtio_net::Hdr::Gso_none)
+        && needs_sw_offload(hdr, request.get()))
+      {
+        handle_sw_offload(request, mangle);
+        return;
+      }
+
+    Virtio_net_transfer *transfer;
+    if (_copy_queue)
+      transfer = new Worker_transfer(request, this, rx_q(), mangle,
+                                     _copy_queue);
+    else
+      transfer = new Virtio_net_transfer(request, this, rx_q(), _stats,
+                                         mangle);
+
+    if (   L4_UNLIKELY(_validate_csum) && guest_features().guest_csum()
+        && request->checksum_valid())
+      {
+        transfer->set_data_valid();
+        ++_stats->csum_validated;
+      }
+
+    schedule_transfer(transfer, request->priority());
+  }
+
+  /**
+   * Check whether a packet uses offloads the guest did not negotiate.
+   *
+   * Only UDP segmentation and checksum offloading are offered to guests, see
+   * Virtio_net::enable_uso(). Packets with other segmentation types are
+   * passed on unchanged.
+   */
+  bool needs_sw_offload(Virtio_net::Hdr const *hdr,
+                        Virtio_net_request const *request) const
+  {
+    if (hdr->gso_type == Virtio_net::Hdr::Gso_udp_l4)
+      return !guest_feature(request->is_ipv6() ? Feature_guest_uso6
+                                               : Feature_guest_uso4);
+
+    return hdr->flags.need_csum() && !guest_features().guest_csum();
+  }
+
+  /**
+   * Deliver a packet with its checksum completed or segmented into
+   * datagrams by the switch.
+   */
+  void handle_sw_offload(Virtio_net_request::Request_ptr const &request,
+                         Virtio_vlan_mangle const &mangle)
+  {
+    Sw_offload::Frames const *frames = request->sw_frames();
+    if (!frames)
+      return;
+
+    ++_stats->sw_offloads;
+    for (auto const &frame : frames->frames)
+      {
+        Buffer buf(const_cast<l4_uint8_t *>(frame.data()), frame.size());
+
+        Virtio_net_transfer *transfer;
+        if (_copy_queue)
+          transfer = new Worker_transfer(request, &frames->hdr, buf, this,
+                                         rx_q(), mangle, _copy_queue);
+        else
+          transfer = new Virtio_net_transfer(request, &frames->hdr, buf, this,
+                                             rx_q(), _stats, mangle);
+
+        schedule_transfer(transfer, request->priority());
+      }
+  }
+
+  /**
+   * Merge a TCP segment into the large packet for the guest.
+   *
+   * \retval true   The segment was merged or copied into a new large packet.
+   * \retval false  The segment shall be delivered unchanged. A pending large
+   *                packet was delivered before to keep the order of packets.
+   */
+  bool gro_receive(Virtio_port *src_port,
+                   Virtio_net_request::Request_ptr const &request,
+                   Virtio_vlan_mangle const &mangle)
+  {
+    Features gf = guest_features();
+    Tcp_gro::Segment seg;
+    bool eligible = gf.guest_csum() && (gf.guest_tso4() || gf.guest_tso6())
+                    && Tcp_gro::parse(request.get(), &seg)
+                    && (seg.ipv6 ? gf.guest_tso6() : gf.guest_tso4())
+                    && (   request->header()->flags.need_csum()
+                        || request->checksum_valid());
+
+    if (_gro.active())
+      {
+        if (eligible && _gro.append(request.get(), seg, src_port))
+          {
+            ++_stats->gro_merged;
+            if (_gro.complete())
+              flush_gro();
+            return true;
+          }
+
+        flush_gro();
+      }
+
+    return eligible && _gro.start(request.get(), seg, src_port, mangle,
+                                  request->priority());
+  }
+
+  /** Deliver the pending large packet for the guest, if any. */
+  void flush_gro()
+  {
+    if (!_gro.active())
+      return;
+
+    Virtio_vlan_mangle mangle;
+    l4_uint8_t priority;
+    Virtio_net_transfer::Local_frame *frame = _gro.finish(&mangle, &priority);
+
+    Virtio_net_transfer *transfer;
+    if (_copy_queue)
+      transfer = new Worker_transfer(frame, this, rx_q(), mangle, _copy_queue);
+    else
+      transfer = new Virtio_net_transfer(frame, this, rx_q(), _stats, mangle);
+
+    schedule_transfer(transfer, priority);
+  }
+
+  /**
+   * Deliver a transfer through the gates and the shaper of the port.
+   *
+   * \param transfer  Transfer to deliver. The port takes over ownership.
+   * \param priority  Priority of the packet, see Gate_control.
+   */
+  void schedule_transfer(Virtio_net_transfer *transfer, l4_uint8_t priority)
+  {
+    if (L4_UNLIKELY(_gates.active() || _shaper.active()))
+      {
+        transfer->set_traffic_class(priority);
+        if (hold_transfer(transfer))
+          return;
+      }
+
+    send_transfer(transfer);
+  }
+
+  /**
+   * Deliver a transfer or add it to the list of pending requests.
+   *
+   * \param transfer  Transfer to deliver. The port takes over ownership.
+   */
+  void send_transfer(Virtio_net_transfer *transfer)
+  {
+    if (_copy_queue)
+      {
+        auto *worker_transfer = static_cast<Worker_transfer *>(transfer);
+        worker_transfer->set_seq(_copy_queue->next_seq());
+        // Never pass packets waiting for buffers of the receive queue.
+        if (   !_pending_requests.empty() || !_copy_queue->resume()
+            || !_copy_queue->submit(worker_transfer))
+          defer_transfer(worker_transfer);
+        return;
+      }
+
+    auto transfer_ptr = cxx::make_unique_ptr(transfer);
     if (transfer_ptr->transfer())
+      {
+        map_guest_mem(transfer_ptr->dst_buffer());
+        return;
+      }
+
+    defer_transfer(transfer_ptr.release());
+  }
+
+  /**
+   * Hold a transfer if the gate of its traffic class is closed or the shaper
+   * of the port has no tokens for it.
+   *
+   * \param transfer  Transfer to deliver.
+   *
+   * \retval true   The transfer is held until it may be delivered or it
+   *                times out.
+   * \retval false  The transfer shall be delivered.
+   *
+   * Held transfers are released first to keep their order.
+   */
+  bool hold_transfer(Virtio_net_transfer *transfer)
+  {
+    l4_cpu_time_t now = l4_kip_clock(l4re_kip());
+    bool shaped = false;
+    if (!_held_requests.empty())
+      shaped = release_held_requests(now);
+
+    l4_cpu_time_t wakeup;
+    l4_uint8_t open = _gates.gates(now, &wakeup);
+    if (!(open & (1U << transfer->traffic_class())))
+      ++_stats->gate_holds;
+    else if (   _shaper.active()
+             && (shaped || !_shaper.consume(transfer->packet_length(), now)))
+      {
+        ++_stats->shaper_holds;
+        wakeup = _shaper.ready_at(transfer->packet_length(), now);
+      }
+    else
+      return false;
+
+    _held_requests.push_back(transfer);
+    server_iface()->add_timeout(transfer, now + 2 * 1000000);
+    arm_hold_timeout(wakeup);
+    return true;
+  }
+
+  /**
+   * Deliver the held transfers whose gates are open as long as the shaper
+   * has tokens for them.
+   *
+   * \param now  Current time in microseconds (KIP clock).
+   *
+   * \retval true   A transfer waits for tokens of the shaper.
+   * \retval false  Only transfers of closed gates are left, if any.
+   */
+  bool release_held_requests(l4_cpu_time_t now)
+  {
+    l4_cpu_time_t wakeup;
+    l4_uint8_t open = _gates.gates(now, &wakeup);
+    bool shaped = false;
+
+    auto iter = _held_requests.begin();
+    while (iter != _held_requests.end())
+      {
+        auto *transfer = *iter;
+        if (!(open & (1U << transfer->traffic_class())))
+          {
+            ++iter;
+            continue;
+          }
+
+        if (   _shaper.active()
+            && !_shaper.consume(transfer->packet_length(), now))
+          {
+            // Later transfers must not overtake this one.
+            shaped = true;
+            l4_cpu_time_t ready = _shaper.ready_at(transfer->packet_length(),
+                                                   now);
+            if (ready < wakeup)
+              wakeup = ready;
+            break;
+          }
+
+        iter = _held_requests.erase(iter);
+        server_iface()->remove_timeout(transfer);
+        send_transfer(transfer);
+      }
+
+    if (!_held_requests.empty())
+      arm_hold_timeout(wakeup);
+
+    return shaped;
+  }
+
+  /** Arm the hold timeout unless it already expires earlier. */
+  void arm_hold_timeout(l4_cpu_time_t when)
+  {
+    if (_hold_timeout_at)
+      {
+        if (_hold_timeout_at <= when)
+          return;
+        server_iface()->remove_timeout(&_hold_timeout);
+      }
+
+    server_iface()->add_timeout(&_hold_timeout, when);
+    _hold_timeout_at = when;
+  }
+
+  /** Get the gate control list of the port as egress port. */
+  Gate_control &gates()
+  { return _gates; }
+
+  /** Get the rate limit of the port as egress port. */
+  Egress_shaper &shaper()
+  { return _shaper; }
+
+  /**
+   * Add a transfer to the list of pending requests.
+   *
+   * \param transfer  Transfer that could not be delivered yet.
+   *
+   * The transfer stays in the list until either a timeout triggers or free
+   * space in the receive queue allows us to finish it.
+   */
+  void defer_transfer(Virtio_net_transfer *transfer)
+  { defer_transfer(transfer, _pending_requests.end()); }
+
+  /**
+   * Add a transfer handed back by the copy worker to the list of pending
+   * requests.
+   *
+   * \param transfer  Transfer the copy worker could not deliver.
+   *
+   * The workers hand back the jobs of a stalled copy queue in order, but the
+   * server thread processes the completions of one worker after the other.
+   * Sort the transfer in, so the pending requests stay in packet order.
+   */
+  void requeue_transfer(Worker_transfer *transfer)
+  {
+    auto pos = _pending_requests.end();
+    while (pos != _pending_requests.begin())
+      {
+        auto prev = pos;
+        --prev;
+        if (!transfer->before(static_cast<Worker_transfer *>(*prev)))
+          break;
+        pos = prev;
+      }
+
+    defer_transfer(transfer, pos);
+  }
+
+  /**
+   * Hand the pending requests to the copy worker for another attempt.
+   *
+   * Requests the worker cannot take right now stay in the list. A stalled
+   * copy queue takes no requests until the workers handed back all its jobs.
+   */
+  void resubmit_pending_requests()
+  {
+    if (!_copy_queue->resume())
       return;
 
-    auto *transfer = transfer_ptr.release();
-    _pending_requests.push_back(transfer);
+    auto iter = _pending_requests.begin();
+    while (iter != _pending_requests.end() && _copy_queue->can_submit())
+      {
+        auto *transfer = static_cast<Worker_transfer *>(*iter);
+        iter = _pending_requests.erase(iter);
+        server_iface()->remove_timeout(transfer);
+        _copy_queue->submit(transfer);
+      }
+  }
+
+private:
+  /**
+   * Add a transfer to the list of pending requests before a given entry.
+   */
+  void defer_transfer(Virtio_net_transfer *transfer,
+                      Virtio_net_transfer::Pending_list::Iterator pos)
+  {
+    // The port might have been quarantined while the copy worker tried.
+    if (L4_UNLIKELY(_rx_quarantined))
+      {
+        drop_transfer(transfer);
+        return;
+      }
+
+    // A stall starts with the first request waiting for buffers.
+    if (_pending_requests.empty())
+      _rx_stall_start = l4_kip_clock(l4re_kip());
+
+    _pending_requests.insert_before(transfer, pos);
     // Timeout is hardcoded at the moment and will be replaced by a
     // configurable value in a follow-up commit
     server_iface()->add_timeout(transfer,
@@ -359,5 +1167,20 @@ public:
     trace.printf("\t%s: Adding transfer %p to list\n", get_name(), transfer);
     dump_pending_requests();
   }
+
+  /**
+   * Drop a transfer that is not pending (anymore) due to quarantine.
+   *
+   * A transfer that already consumed buffers of the receive queue must return
+   * them. In the pipelined case only the copy worker may do so.
+   */
+  void drop_transfer(Virtio_net_transfer *transfer)
+  {
+    ++_stats->quarantine_drops;
+    if (_copy_queue && transfer->started())
+      _copy_queue->submit_finish(static_cast<Worker_transfer *>(transfer));
+    else
+      delete transfer;
+  }
 };
 /**\}*/
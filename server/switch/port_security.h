@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2024 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <l4/re/env>
+#include <l4/sys/kip>
+#include <l4/sys/types.h>
+
+/**
+ * \ingroup virtio_net_switch
+ * \{
+ */
+
+/**
+ * Restrictions for learning MAC addresses on a port.
+ *
+ * Without restrictions a guest sending frames with random source addresses
+ * evicts all legitimate entries from the MAC table, so unicast traffic to
+ * all ports is flooded. Port security bounds the number of addresses a port
+ * may own and the rate at which it may learn new ones. On a sticky port the
+ * learned addresses are bound to the port: they are neither evicted nor
+ * moved to another port, and frames with other source addresses are dropped
+ * once the limit is reached.
+ *
+ * The MAC table maintains the number of addresses owned by the port.
+ */
+class Port_security
+{
+public:
+  /**
+   * Limit the number of addresses learned on the port.
+   *
+   * \param max_macs  Maximum number of addresses, 0 for no limit.
+   */
+  void set_max_macs(unsigned max_macs)
+  { _max_macs = max_macs; }
+
+  /**
+   * Limit the rate at which the port learns new addresses.
+   *
+   * \param rate  Maximum number of new addresses per second, 0 for no limit.
+   *              Up to \a rate addresses may be learned in a burst.
+   */
+  void set_learn_rate(unsigned rate)
+  {
+    _learn_rate = rate;
+    _tokens = rate;
+    _last_refill = l4_kip_clock(l4re_kip());
+  }
+
+  /**
+   * Bind learned addresses to the port.
+   *
+   * A sticky port without limit owns at most one address.
+   */
+  void set_sticky()
+  {
+    _sticky = true;
+    if (!_max_macs)
+      _max_macs = 1;
+  }
+
+  /** Check whether learned addresses are bound to the port. */
+  bool sticky() const
+  { return _sticky; }
+
+  /**
+   * Check whether the port may learn another address.
+   *
+   * \retval true   The address may be learned. A learn token was consumed.
+   * \retval false  The port reached its limit or exceeded its learn rate.
+   */
+  bool may_learn()
+  {
+    if (_max_macs && _num_macs >= _max_macs)
+      return false;
+
+    if (!_learn_rate)
+      return true;
+
+    if (!_tokens)
+      {
+        l4_cpu_time_t now = l4_kip_clock(l4re_kip());
+        l4_uint64_t refill = (now - _last_refill) * _learn_rate / 1000000;
+        if (!refill)
+          return false;
+
+        _tokens = refill < _learn_rate ? refill : _learn_rate;
+        _last_refill = now;
+      }
+
+    --_tokens;
+    return true;
+  }
+
+  /** Note an address learned on the port (MAC table only). */
+  void add_mac()
+  { ++_num_macs; }
+
+  /** Note an address removed from the port (MAC table only). */
+  void remove_mac()
+  { --_num_macs; }
+
+private:
+  unsigned _max_macs = 0;
+  unsigned _learn_rate = 0;
+  bool _sticky = false;
+
+  /// Number of addresses the port currently owns in the MAC table.
+  unsigned _num_macs = 0;
+  unsigned _tokens = 0;
+  l4_cpu_time_t _last_refill = 0;
+};
+/**\}*/
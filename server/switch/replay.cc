@@ -0,0 +1,924 @@
+/*
+ * Copyright (C) 2024 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#include <l4/re/env>
+#include <l4/re/error_helper>
+#include <l4/re/mem_alloc>
+#include <l4/re/util/unique_cap>
+#include <l4/sys/kip>
+#include <l4/util/rdtsc.h>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "switch.h"
+#include "vlan.h"
+
+/**
+ * \ingroup virtio_net_switch
+ * \{
+ */
+
+/*
+ * Replay of captured packet traces through the switching core.
+ *
+ * The replay creates a Virtio_switch with ports whose guests are faked by
+ * this program: it drives the virtqueues of the ports directly in memory,
+ * puts the frames of a pcap or pcapng trace into the transmission queues of
+ * their ingress ports and lets the switch forward them as fast as it can.
+ * No IPC or IRQ is involved, so the measurement covers the switching core
+ * only. See "Replaying packet traces" in the documentation.
+ */
+
+/** Layout of a descriptor in a split virtqueue, see the Virtio spec. */
+struct Vring_desc
+{
+  enum : l4_uint16_t { F_write = 2 };
+
+  l4_uint64_t addr;
+  l4_uint32_t len;
+  l4_uint16_t flags;
+  l4_uint16_t next;
+};
+
+/** Layout of the available ring of a split virtqueue. */
+struct Vring_avail
+{
+  enum : l4_uint16_t { F_no_interrupt = 1 };
+
+  l4_uint16_t flags;
+  l4_uint16_t idx;
+  l4_uint16_t ring[];
+};
+
+/** Layout of the used ring of a split virtqueue. */
+struct Vring_used
+{
+  struct Elem
+  {
+    l4_uint32_t id;
+    l4_uint32_t len;
+  };
+
+  l4_uint16_t flags;
+  l4_uint16_t idx;
+  Elem ring[];
+};
+
+/**
+ * Driver side of a virtqueue whose buffers are handed out by the replay.
+ *
+ * Each buffer consists of a single descriptor, whose index is the index of
+ * the buffer.
+ */
+class Fake_queue
+{
+public:
+  /** Size of the memory of a queue with `num` entries and buffers. */
+  static l4_size_t mem_size(unsigned num, l4_uint32_t buf_size)
+  { return 3 * ring_size(num) + num * buf_size; }
+
+  /**
+   * Set up the queue.
+   *
+   * \param local       Memory of the queue in the address space of the
+   *                    replay, at least `mem_size()` bytes.
+   * \param guest_addr  Address of the memory as the switch sees it in the
+   *                    descriptors.
+   * \param num         Number of entries and buffers.
+   * \param buf_size    Size of each buffer.
+   */
+  void init(char *local, l4_uint64_t guest_addr, unsigned num,
+            l4_uint32_t buf_size)
+  {
+    l4_size_t rs = ring_size(num);
+    _desc = reinterpret_cast<Vring_desc *>(local);
+    _avail = reinterpret_cast<Vring_avail *>(local + rs);
+    _used = reinterpret_cast<Vring_used *>(local + 2 * rs);
+    _bufs = local + 3 * rs;
+    _bufs_addr = guest_addr + 3 * rs;
+    _num = num;
+    _buf_size = buf_size;
+
+    // The replay collects the used buffers itself, the switch shall not
+    // try to notify it.
+    _avail->flags = Vring_avail::F_no_interrupt;
+  }
+
+  Vring_desc *desc() const { return _desc; }
+  Vring_avail *avail() const { return _avail; }
+  Vring_used *used() const { return _used; }
+  unsigned num() const { return _num; }
+
+  /** Get the local address of a buffer. */
+  char *buf(l4_uint16_t id) const
+  { return _bufs + id * _buf_size; }
+
+  /**
+   * Hand a buffer to the switch.
+   *
+   * \param id        Index of the buffer.
+   * \param len       Number of bytes the switch may read or write.
+   * \param writable  The switch writes to the buffer.
+   *
+   * The buffer becomes visible to the switch with the next `publish()`.
+   */
+  void add(l4_uint16_t id, l4_uint32_t len, bool writable)
+  {
+    Vring_desc *d = &_desc[id];
+    d->addr = _bufs_addr + id * _buf_size;
+    d->len = len;
+    d->flags = writable ? Vring_desc::F_write : 0;
+    d->next = 0;
+    _avail->ring[_avail_idx++ & (_num - 1)] = id;
+  }
+
+  /** Make the buffers added since the last call visible to the switch. */
+  void publish()
+  {
+    L4virtio::wmb();
+    _avail->idx = _avail_idx;
+  }
+
+  /**
+   * Take a buffer the switch is done with.
+   *
+   * \param[out] id   Index of the buffer.
+   * \param[out] len  Number of bytes the switch wrote.
+   *
+   * \retval true   A buffer was returned.
+   * \retval false  The switch did not return any further buffer.
+   */
+  bool next_used(l4_uint16_t *id, l4_uint32_t *len)
+  {
+    if (_used_idx == *const_cast<l4_uint16_t volatile *>(&_used->idx))
+      return false;
+
+    L4virtio::rmb();
+    Vring_used::Elem const &e = _used->ring[_used_idx++ & (_num - 1)];
+    *id = e.id;
+    *len = e.len;
+    return true;
+  }
+
+private:
+  /** Size reserved for each of the rings, keeping them page aligned. */
+  static l4_size_t ring_size(unsigned num)
+  { return l4_round_page(num * sizeof(Vring_desc)); }
+
+  Vring_desc *_desc = nullptr;
+  Vring_avail *_avail = nullptr;
+  Vring_used *_used = nullptr;
+  char *_bufs = nullptr;
+  l4_uint64_t _bufs_addr = 0;
+  unsigned _num = 0;
+  l4_uint32_t _buf_size = 0;
+  l4_uint16_t _avail_idx = 0;
+  l4_uint16_t _used_idx = 0;
+};
+
+/**
+ * A switch port whose guest is faked by the replay.
+ *
+ * The port registers a single dataspace containing both virtqueues and their
+ * buffers, and negotiates the features a Linux guest would negotiate. The
+ * receive queue is always filled with buffers for full-sized frames.
+ */
+class Replay_port : public Virtio_port
+{
+public:
+  enum : l4_uint32_t
+  {
+    Buf_size = 2048,  ///< Size of each buffer in both queues
+    /// Largest frame that fits into a buffer with the virtio-net header.
+    Max_frame = Buf_size - sizeof(Virtio_net::Hdr),
+  };
+
+  Replay_port(char const *name, unsigned num)
+  : Virtio_port(num, 1, name, nullptr, false)
+  {
+    l4_size_t qsize = Fake_queue::mem_size(num, Buf_size);
+    l4_size_t size = l4_round_page(2 * qsize);
+
+    auto ds = L4Re::chkcap(L4Re::Util::make_unique_cap<L4Re::Dataspace>(),
+                           "Allocate replay dataspace capability.");
+    L4Re::chksys(L4Re::Env::env()->mem_alloc()->alloc(size, ds.get()),
+                 "Allocate replay dataspace.");
+
+    // The switch attaches the dataspace like any dataspace a guest
+    // registers. The replay accesses the queues through the same mapping.
+    auto const *region = _mem_info.add(Guest_base, size, 0, std::move(ds));
+    if (!region)
+      L4Re::chksys(-L4_ENOMEM, "Register replay dataspace.");
+
+    char *local = region->local(L4virtio::Ptr<char>(Guest_base));
+    _tx.init(local, Guest_base, num, Buf_size);
+    _rx.init(local + qsize, Guest_base + qsize, num, Buf_size);
+
+    Features gf(0);
+    gf.mrg_rxbuf() = true;
+    _dev_config.hdr()->driver_features_map[0] = gf.raw;
+    // VIRTIO_F_VERSION_1
+    _dev_config.hdr()->driver_features_map[1] = 1;
+
+    tx_q()->setup(num, _tx.desc(), _tx.avail(), _tx.used());
+    rx_q()->setup(num, _rx.desc(), _rx.avail(), _rx.used());
+
+    for (unsigned i = 0; i < num; ++i)
+      {
+        _rx.add(i, Buf_size, true);
+        _tx_free.push_back(i);
+      }
+    _rx.publish();
+  }
+
+  L4::Cap<L4::Irq> device_notify_irq() const override
+  { return L4::Cap<L4::Irq>(); }
+
+  /** Number of frames the port can send without reaping buffers. */
+  unsigned tx_space() const
+  { return _tx_free.size(); }
+
+  /**
+   * Put a frame into the transmission queue.
+   *
+   * The frame becomes visible to the switch with `publish()`.
+   */
+  void send(l4_uint8_t const *frame, l4_uint32_t len)
+  {
+    l4_uint16_t id = _tx_free.back();
+    _tx_free.pop_back();
+
+    char *buf = _tx.buf(id);
+    memset(buf, 0, sizeof(Virtio_net::Hdr));
+    memcpy(buf + sizeof(Virtio_net::Hdr), frame, len);
+    _tx.add(id, sizeof(Virtio_net::Hdr) + len, false);
+  }
+
+  /** Make the frames sent since the last call visible to the switch. */
+  void publish()
+  { _tx.publish(); }
+
+  /**
+   * Collect the buffers the switch is done with.
+   *
+   * Received frames are counted and their buffers handed back to the switch
+   * right away.
+   */
+  void reap()
+  {
+    l4_uint16_t id;
+    l4_uint32_t len;
+
+    while (_tx.next_used(&id, &len))
+      _tx_free.push_back(id);
+
+    bool received = false;
+    while (_rx.next_used(&id, &len))
+      {
+        ++rx_frames;
+        rx_bytes += len - sizeof(Virtio_net::Hdr);
+        _rx.add(id, Buf_size, true);
+        received = true;
+      }
+
+    if (received)
+      _rx.publish();
+  }
+
+  l4_uint64_t rx_frames = 0;  ///< Frames delivered to the fake guest
+  l4_uint64_t rx_bytes = 0;   ///< Bytes delivered to the fake guest
+
+private:
+  /// Address of the dataspace in the fake guest's physical address space.
+  enum : l4_uint64_t { Guest_base = 0x10000000 };
+
+  Fake_queue _tx;
+  Fake_queue _rx;
+  std::vector<l4_uint16_t> _tx_free;
+};
+
+/**
+ * Ethernet frames of a packet trace in pcap or pcapng format.
+ */
+class Trace
+{
+public:
+  struct Frame
+  {
+    l4_size_t offset;    ///< Offset of the frame in the trace data
+    l4_uint32_t len;     ///< Captured length of the frame
+    l4_uint32_t iface;   ///< Capture interface (pcapng), 0 for pcap
+  };
+
+  /**
+   * Load a trace file.
+   *
+   * \param path  Path of the trace.
+   *
+   * \retval true   The trace was loaded.
+   * \retval false  The file could not be read or has an unknown format.
+   */
+  bool load(char const *path)
+  {
+    FILE *f = fopen(path, "r");
+    if (!f)
+      {
+        Err().printf("Cannot open trace '%s'\n", path);
+        return false;
+      }
+
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+      _data.insert(_data.end(), chunk, chunk + n);
+    fclose(f);
+
+    if (_data.size() >= 4 && read32(0, false) == Pcapng_shb)
+      return load_pcapng();
+
+    return load_pcap();
+  }
+
+  std::vector<Frame> const &frames() const
+  { return _frames; }
+
+  l4_uint8_t const *data(Frame const &f) const
+  { return _data.data() + f.offset; }
+
+  /** Frames of capture interfaces that are not Ethernet. */
+  l4_uint64_t non_ethernet = 0;
+  /** Frames captured with less than their original length. */
+  l4_uint64_t truncated = 0;
+
+private:
+  enum : l4_uint32_t
+  {
+    Pcap_magic_us = 0xa1b2c3d4,
+    Pcap_magic_ns = 0xa1b23c4d,
+    Pcapng_shb = 0x0a0d0d0a,
+    Pcapng_bom = 0x1a2b3c4d,
+    Pcapng_idb = 1,
+    Pcapng_pb = 2,
+    Pcapng_spb = 3,
+    Pcapng_epb = 6,
+    Linktype_ethernet = 1,
+  };
+
+  l4_uint16_t read16(l4_size_t off, bool swap) const
+  {
+    l4_uint16_t v;
+    memcpy(&v, &_data[off], sizeof(v));
+    return swap ? __builtin_bswap16(v) : v;
+  }
+
+  l4_uint32_t read32(l4_size_t off, bool swap) const
+  {
+    l4_uint32_t v;
+    memcpy(&v, &_data[off], sizeof(v));
+    return swap ? __builtin_bswap32(v) : v;
+  }
+
+  void add_frame(l4_size_t offset, l4_uint32_t caplen, l4_uint32_t origlen,
+                 l4_uint32_t iface, bool ethernet)
+  {
+    if (!ethernet)
+      {
+        ++non_ethernet;
+        return;
+      }
+
+    if (caplen < origlen)
+      ++truncated;
+    _frames.push_back(Frame{offset, caplen, iface});
+  }
+
+  bool load_pcap()
+  {
+    if (_data.size() < 24)
+      {
+        Err().printf("Trace too short for a pcap header\n");
+        return false;
+      }
+
+    bool swap;
+    l4_uint32_t magic = read32(0, false);
+    if (magic == Pcap_magic_us || magic == Pcap_magic_ns)
+      swap = false;
+    else if (   magic == __builtin_bswap32(Pcap_magic_us)
+             || magic == __builtin_bswap32(Pcap_magic_ns))
+      swap = true;
+    else
+      {
+        Err().printf("Trace is neither in pcap nor in pcapng format\n");
+        return false;
+      }
+
+    bool ethernet = (read32(20, swap) & 0xffff) == Linktype_ethernet;
+    l4_size_t off = 24;
+    while (off + 16 <= _data.size())
+      {
+        l4_uint32_t caplen = read32(off + 8, swap);
+        l4_uint32_t origlen = read32(off + 12, swap);
+        off += 16;
+        if (caplen > _data.size() - off)
+          {
+            Err().printf("Trace ends within a packet\n");
+            break;
+          }
+
+        add_frame(off, caplen, origlen, 0, ethernet);
+        off += caplen;
+      }
+
+    return true;
+  }
+
+  bool load_pcapng()
+  {
+    bool swap = false;
+    std::vector<bool> ethernet;
+    l4_size_t off = 0;
+    while (off + 12 <= _data.size())
+      {
+        l4_uint32_t type = read32(off, swap);
+        if (type == Pcapng_shb)
+          {
+            // The byte order of each section is given by its header.
+            swap = read32(off + 8, false) != Pcapng_bom;
+            ethernet.clear();
+          }
+
+        l4_uint32_t len = read32(off + 4, swap);
+        if (len < 12 || len % 4 || len > _data.size() - off)
+          {
+            Err().printf("Invalid pcapng block at offset %zu\n", off);
+            return !_frames.empty();
+          }
+
+        l4_size_t body = off + 8;
+        l4_uint32_t body_len = len - 12;
+        switch (type)
+          {
+          case Pcapng_idb:
+            if (body_len >= 8)
+              ethernet.push_back(read16(body, swap) == Linktype_ethernet);
+            break;
+
+          case Pcapng_epb:
+          case Pcapng_pb:
+            if (body_len >= 20)
+              {
+                l4_uint32_t iface = type == Pcapng_epb ? read32(body, swap)
+                                                       : read16(body, swap);
+                l4_uint32_t caplen = read32(body + 12, swap);
+                l4_uint32_t origlen = read32(body + 16, swap);
+                if (caplen <= body_len - 20)
+                  add_frame(body + 20, caplen, origlen, iface,
+                            iface < ethernet.size() && ethernet[iface]);
+              }
+            break;
+
+          case Pcapng_spb:
+            if (body_len >= 4)
+              {
+                // The captured length is only limited by the block size.
+                l4_uint32_t origlen = read32(body, swap);
+                l4_uint32_t caplen = origlen < body_len - 4 ? origlen
+                                                            : body_len - 4;
+                add_frame(body + 4, caplen, origlen, 0,
+                          !ethernet.empty() && ethernet[0]);
+              }
+            break;
+
+          default:
+            break;
+          }
+
+        off += len;
+      }
+
+    return true;
+  }
+
+  std::vector<l4_uint8_t> _data;
+  std::vector<Frame> _frames;
+};
+
+/**
+ * Assignment of the frames of a trace to the ports they are sent from.
+ *
+ * Each line of a port map describes one port:
+ *
+ *     <name> [vlan=<id> | trunk=<id>[,<id>...]] [<selector> ...]
+ *
+ * A selector is a source MAC address, `if=<n>` for the capture interface
+ * `n` of a pcapng trace, or `*` for all frames not selected otherwise.
+ * Source MAC addresses take precedence over interfaces. Empty lines and
+ * lines starting with `#` are ignored.
+ */
+class Port_map
+{
+public:
+  struct Port
+  {
+    std::string name;
+    l4_uint16_t vlan_access = 0;
+    std::vector<l4_uint16_t> vlan_trunk;
+  };
+
+  /**
+   * Load a port map.
+   *
+   * \param path  Path of the port map.
+   *
+   * \retval true   The port map was loaded.
+   * \retval false  The file could not be read or is invalid.
+   */
+  bool load(char const *path)
+  {
+    FILE *f = fopen(path, "r");
+    if (!f)
+      {
+        Err().printf("Cannot open port map '%s'\n", path);
+        return false;
+      }
+
+    char line[512];
+    unsigned line_no = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f))
+      ok = parse_line(line, ++line_no);
+    fclose(f);
+
+    if (ok && ports.empty())
+      {
+        Err().printf("Port map '%s' defines no ports\n", path);
+        ok = false;
+      }
+
+    return ok;
+  }
+
+  /**
+   * Get the port a frame is sent from.
+   *
+   * \retval >=0  Index of the port.
+   * \retval -1   The frame is not selected by any port.
+   */
+  int port_of(l4_uint8_t const *frame, l4_uint32_t len,
+              l4_uint32_t iface) const
+  {
+    if (len >= 12)
+      {
+        Mac_addr src(reinterpret_cast<char const *>(frame + 6));
+        for (auto const &m : _macs)
+          if (m.addr == src)
+            return m.port;
+      }
+
+    for (auto const &i : _ifaces)
+      if (i.iface == iface)
+        return i.port;
+
+    return _default;
+  }
+
+  std::vector<Port> ports;
+
+private:
+  struct Mac_sel
+  {
+    Mac_addr addr;
+    int port;
+  };
+
+  struct Iface_sel
+  {
+    l4_uint32_t iface;
+    int port;
+  };
+
+  static bool parse_vlan_list(char const *s, std::vector<l4_uint16_t> *ids)
+  {
+    while (*s)
+      {
+        char *end;
+        unsigned long id = strtoul(s, &end, 10);
+        if (end == s || !vlan_valid_id(id) || (*end && *end != ','))
+          return false;
+        ids->push_back(id);
+        s = *end ? end + 1 : end;
+      }
+
+    return !ids->empty();
+  }
+
+  bool parse_line(char *line, unsigned line_no)
+  {
+    char *save;
+    char *tok = strtok_r(line, " \t\r\n", &save);
+    if (!tok || tok[0] == '#')
+      return true;
+
+    int idx = ports.size();
+    ports.push_back(Port());
+    Port &port = ports.back();
+    port.name = tok;
+
+    while ((tok = strtok_r(nullptr, " \t\r\n", &save)))
+      {
+        l4_uint8_t mac[6];
+        int n = 0;
+        if (!strncmp(tok, "vlan=", 5))
+          {
+            char *end;
+            unsigned long id = strtoul(tok + 5, &end, 10);
+            if (end == tok + 5 || *end || !vlan_valid_id(id))
+              break;
+            port.vlan_access = id;
+          }
+        else if (!strncmp(tok, "trunk=", 6))
+          {
+            if (!parse_vlan_list(tok + 6, &port.vlan_trunk))
+              break;
+          }
+        else if (!strncmp(tok, "if=", 3))
+          {
+            char *end;
+            unsigned long iface = strtoul(tok + 3, &end, 10);
+            if (end == tok + 3 || *end)
+              break;
+            _ifaces.push_back(Iface_sel{static_cast<l4_uint32_t>(iface),
+                                        idx});
+          }
+        else if (!strcmp(tok, "*"))
+          _default = idx;
+        else if (   sscanf(tok, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx%n", &mac[0],
+                           &mac[1], &mac[2], &mac[3], &mac[4], &mac[5],
+                           &n) == 6
+                 && !tok[n])
+          _macs.push_back(Mac_sel{Mac_addr(reinterpret_cast<char const *>(mac)),
+                                  idx});
+        else
+          break;
+      }
+
+    if (tok)
+      {
+        Err().printf("Port map line %u: invalid argument '%s'\n", line_no, tok);
+        return false;
+      }
+
+    if (port.vlan_access && !port.vlan_trunk.empty())
+      {
+        Err().printf("Port map line %u: port cannot be access and trunk VLAN"
+                     " port simultaneously\n", line_no);
+        return false;
+      }
+
+    return true;
+  }
+
+  std::vector<Mac_sel> _macs;
+  std::vector<Iface_sel> _ifaces;
+  int _default = -1;
+};
+
+static void
+usage(char const *prog)
+{
+  printf("Usage: %s [-r <rounds>] [-b <batch>] [-q <queue size>] [-p]"
+         " <trace> <port map>\n"
+         "\n"
+         "  -r, --rounds <n>      replay the trace n times (default 1)\n"
+         "  -b, --batch <n>       frames handed to the switch per round"
+         " (default 64)\n"
+         "  -q, --queue-size <n>  entries per virtqueue (default 256)\n"
+         "  -p, --per-port        print statistics for each port\n",
+         prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+  unsigned long rounds = 1;
+  unsigned long batch = 64;
+  unsigned long queue_size = 256;
+  bool per_port = false;
+
+  struct option options[] =
+    {
+      {"rounds",     1, 0, 'r' },
+      {"batch",      1, 0, 'b' },
+      {"queue-size", 1, 0, 'q' },
+      {"per-port",   0, 0, 'p' },
+      {0, 0, 0, 0}
+    };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "r:b:q:p", options, nullptr)) != -1)
+    {
+      switch (opt)
+        {
+        case 'r':
+          rounds = strtoul(optarg, nullptr, 0);
+          break;
+        case 'b':
+          batch = strtoul(optarg, nullptr, 0);
+          break;
+        case 'q':
+          queue_size = strtoul(optarg, nullptr, 0);
+          break;
+        case 'p':
+          per_port = true;
+          break;
+        default:
+          usage(argv[0]);
+          return 1;
+        }
+    }
+
+  if (argc - optind != 2)
+    {
+      usage(argv[0]);
+      return 1;
+    }
+
+  if (   !queue_size || queue_size > 0x8000
+      || (queue_size & (queue_size - 1)))
+    {
+      Err().printf("Queue size must be a power of 2 up to 32768\n");
+      return 1;
+    }
+
+  // Each frame of a round may be flooded to every port, so a round must
+  // fit into the receive queues. The switch never has to defer a frame.
+  if (!batch || batch > queue_size)
+    {
+      Err().printf("Batch size must be between 1 and the queue size\n");
+      return 1;
+    }
+
+  Trace trace;
+  Port_map map;
+  if (!trace.load(argv[optind]) || !map.load(argv[optind + 1]))
+    return 1;
+
+  Virtio_switch sw(map.ports.size());
+  std::vector<Replay_port *> ports;
+  for (auto const &p : map.ports)
+    {
+      auto *port = new Replay_port(p.name.c_str(), queue_size);
+      if (p.vlan_access)
+        port->set_vlan_access(p.vlan_access);
+      else if (!p.vlan_trunk.empty())
+        port->set_vlan_trunk(p.vlan_trunk);
+
+      if (!sw.add_port(port))
+        {
+          Err().printf("Cannot add port '%s'\n", p.name.c_str());
+          return 1;
+        }
+      ports.push_back(port);
+    }
+
+  // Assign the frames to their ports up front, so the replay loop only
+  // copies frames into the transmission queues.
+  struct Job
+  {
+    Trace::Frame const *frame;
+    Replay_port *port;
+  };
+
+  std::vector<Job> jobs;
+  l4_uint64_t unmapped = 0, oversized = 0;
+  for (auto const &f : trace.frames())
+    {
+      if (f.len < 14 || f.len > Replay_port::Max_frame)
+        {
+          ++oversized;
+          continue;
+        }
+
+      int idx = map.port_of(trace.data(f), f.len, f.iface);
+      if (idx < 0)
+        {
+          ++unmapped;
+          continue;
+        }
+
+      jobs.push_back(Job{&f, ports[idx]});
+    }
+
+  printf("Trace: %zu frames, %zu replayed, %llu not mapped to a port,"
+         " %llu runts or larger than %u bytes, %llu not Ethernet,"
+         " %llu truncated\n",
+         trace.frames().size(), jobs.size(),
+         static_cast<unsigned long long>(unmapped),
+         static_cast<unsigned long long>(oversized),
+         static_cast<unsigned>(Replay_port::Max_frame),
+         static_cast<unsigned long long>(trace.non_ethernet),
+         static_cast<unsigned long long>(trace.truncated));
+
+  if (jobs.empty())
+    return 1;
+
+  l4_uint64_t switch_cycles = 0;
+  l4_cpu_time_t start_us = l4_kip_clock(l4re_kip());
+  l4_uint64_t start_cycles = l4_rdtsc();
+
+  for (unsigned long r = 0; r < rounds; ++r)
+    for (size_t next = 0; next < jobs.size();)
+      {
+        size_t end = next + batch < jobs.size() ? next + batch : jobs.size();
+        for (; next < end; ++next)
+          {
+            Job const &j = jobs[next];
+            // A port sending more than a queue full within one round has to
+            // wait for the next one.
+            if (!j.port->tx_space())
+              break;
+
+            j.port->send(trace.data(*j.frame), j.frame->len);
+            sw.queue_port_irq(j.port);
+          }
+
+        for (auto *port : ports)
+          port->publish();
+
+        l4_uint64_t c = l4_rdtsc();
+        sw.handle_port_irqs();
+        switch_cycles += l4_rdtsc() - c;
+
+        for (auto *port : ports)
+          port->reap();
+      }
+
+  l4_uint64_t total_cycles = l4_rdtsc() - start_cycles;
+  l4_cpu_time_t elapsed_us = l4_kip_clock(l4re_kip()) - start_us;
+
+  Port_statistics sum = {};
+  l4_uint64_t rx_frames = 0;
+  for (auto *port : ports)
+    {
+      Port_statistics const *s = port->stats();
+      sum.tx_packets += s->tx_packets;
+      sum.tx_floods += s->tx_floods;
+      sum.mac_hits += s->mac_hits;
+      sum.mac_misses += s->mac_misses;
+      rx_frames += port->rx_frames;
+    }
+
+  l4_uint64_t packets = static_cast<l4_uint64_t>(jobs.size()) * rounds;
+  // The cycle counter tells the share of the switch in the elapsed time,
+  // the KIP clock the elapsed time itself.
+  double switch_ns = elapsed_us * 1000.0 * switch_cycles
+                     / (total_cycles ? total_cycles : 1);
+  double lookups = sum.mac_hits + sum.mac_misses;
+
+  printf("Replayed %llu packets in %llu us (%llu rounds of the trace)\n",
+         static_cast<unsigned long long>(packets),
+         static_cast<unsigned long long>(elapsed_us),
+         static_cast<unsigned long long>(rounds));
+  printf("  switch:      %.0f pps, %.1f ns/packet, %.0f cycles/packet\n",
+         switch_ns ? packets * 1e9 / switch_ns : 0.0, switch_ns / packets,
+         static_cast<double>(switch_cycles) / packets);
+  printf("  with guests: %.0f pps, %.1f ns/packet\n",
+         elapsed_us ? packets * 1e6 / elapsed_us : 0.0,
+         elapsed_us * 1000.0 / packets);
+  printf("  flood ratio: %.2f%% (%llu of %llu packets)\n",
+         sum.tx_packets ? 100.0 * sum.tx_floods / sum.tx_packets : 0.0,
+         static_cast<unsigned long long>(sum.tx_floods),
+         static_cast<unsigned long long>(sum.tx_packets));
+  printf("  MAC hits:    %.2f%% (%llu of %.0f unicast lookups)\n",
+         lookups ? 100.0 * sum.mac_hits / lookups : 0.0,
+         static_cast<unsigned long long>(sum.mac_hits), lookups);
+  printf("  delivered:   %llu frames (%.2f per packet)\n",
+         static_cast<unsigned long long>(rx_frames),
+         static_cast<double>(rx_frames) / packets);
+
+  if (per_port)
+    for (auto *port : ports)
+      {
+        Port_statistics const *s = port->stats();
+        printf("  %-19s tx %llu flooded %llu hits %llu misses %llu rx %llu\n",
+               port->get_name(),
+               static_cast<unsigned long long>(s->tx_packets),
+               static_cast<unsigned long long>(s->tx_floods),
+               static_cast<unsigned long long>(s->mac_hits),
+               static_cast<unsigned long long>(s->mac_misses),
+               static_cast<unsigned long long>(port->rx_frames));
+      }
+
+  return 0;
+}
+/**\}*/
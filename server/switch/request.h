@@ -11,8 +11,11 @@
 
 #include <l4/l4virtio/server/virtio>
 #include <l4/cxx/ref_ptr>
+#include <l4/cxx/unique_ptr>
 #include <l4/util/assert.h>
 
+#include "checksum.h"
+#include "sw_offload.h"
 #include "virtio_net_buffer.h"
 #include "virtio_net.h"
 #include "mac_addr.h"
@@ -60,9 +63,119 @@ private:
   Virtio_net::Hdr *_header;
   Buffer _pkt;
 
+  /** Length of the packet, 0 until computed by length(). */
+  l4_uint32_t _length = 0;
+
+  enum Csum_state : l4_uint8_t { Csum_unchecked, Csum_valid, Csum_invalid };
+  /** Result of checksum_valid(). */
+  Csum_state _csum_state = Csum_unchecked;
+
+  /** Result of sw_frames(), nullptr until first used. */
+  cxx::unique_ptr<Sw_offload::Frames> _sw_frames;
+
   bool _next_buffer(Buffer *buf)
   { return _req_proc.next(_dev->mem_info(), buf); }
 
+  bool verify_checksum()
+  {
+    if (   !_header || _header->flags.need_csum()
+        || _header->gso_type != Virtio_net::Hdr::Gso_none)
+      return false;
+
+    auto const *p = reinterpret_cast<l4_uint8_t const *>(_pkt.pos);
+    l4_uint32_t left = _pkt.left;
+    l4_uint32_t off = 12;
+    if (left < off + 2)
+      return false;
+
+    l4_uint16_t type = (l4_uint16_t)p[off] << 8 | p[off + 1];
+    if (type == 0x8100U)
+      {
+        off += 4;
+        if (left < off + 2)
+          return false;
+        type = (l4_uint16_t)p[off] << 8 | p[off + 1];
+      }
+    off += 2;
+
+    Inet_checksum csum;
+    l4_uint8_t proto;
+    l4_uint32_t l4_len;
+    if (type == 0x0800U)
+      {
+        l4_uint8_t const *ip = p + off;
+        if (left < off + 20 || (ip[0] >> 4) != 4)
+          return false;
+
+        l4_uint32_t ihl = (ip[0] & 0xfU) * 4;
+        if (ihl < 20 || left < off + ihl)
+          return false;
+
+        // Fragments are verified by the guest after reassembly.
+        if ((ip[6] & 0x3fU) || ip[7])
+          return false;
+
+        l4_uint32_t total = (l4_uint32_t)ip[2] << 8 | ip[3];
+        if (total < ihl)
+          return false;
+
+        proto = ip[9];
+        l4_len = total - ihl;
+        off += ihl;
+        csum.add(ip + 12, 8);
+      }
+    else if (type == 0x86ddU)
+      {
+        l4_uint8_t const *ip = p + off;
+        if (left < off + 40)
+          return false;
+
+        proto = ip[6];
+        l4_len = (l4_uint32_t)ip[4] << 8 | ip[5];
+        off += 40;
+        csum.add(ip + 8, 32);
+      }
+    else
+      return false;
+
+    if (proto == 17)
+      {
+        // A UDP checksum of 0 means the sender did not compute one.
+        if (left < off + 8 || (!p[off + 6] && !p[off + 7]))
+          return false;
+      }
+    else if (proto != 6)
+      return false;
+
+    if (left < off)
+      return false;
+
+    csum.add_u16(proto);
+    csum.add_u16(l4_len);
+
+    l4_uint32_t chunk = left - off < l4_len ? left - off : l4_len;
+    csum.add(p + off, chunk);
+    l4_uint32_t todo = l4_len - chunk;
+
+    L4virtio::Svr::Request_processor req_proc = _req_proc;
+    Buffer buf = _pkt;
+    try
+      {
+        while (todo && req_proc.next(_dev->mem_info(), &buf))
+          {
+            chunk = buf.left < todo ? buf.left : todo;
+            csum.add(buf.pos, chunk);
+            todo -= chunk;
+          }
+      }
+    catch (L4virtio::Svr::Bad_descriptor const &)
+      {
+        return false;
+      }
+
+    return !todo && csum.valid();
+  }
+
   /**
    * Finalize request
    *
@@ -278,6 +391,128 @@ public:
     return ((uint16_t)p[14] << 8 | (uint16_t)p[15]) & 0xfffU;
   }
 
+  /** Get the priority code point of the VLAN tag, 0 if untagged. */
+  l4_uint8_t priority() const
+  {
+    if (!has_vlan() || _pkt.left < 16)
+      return 0;
+
+    uint8_t *p = reinterpret_cast<uint8_t*>(_pkt.pos);
+    return p[14] >> 5;
+  }
+
+  /**
+   * Get the length of the packet without the virtio-net header.
+   *
+   * Walks the remaining descriptors of the request on first use. A broken
+   * descriptor chain ends the packet; the copy reports the actual error.
+   */
+  l4_uint32_t length()
+  {
+    if (_length)
+      return _length;
+
+    L4virtio::Svr::Request_processor req_proc = _req_proc;
+    Buffer buf = _pkt;
+    l4_uint32_t length = buf.left;
+    try
+      {
+        while (req_proc.next(_dev->mem_info(), &buf))
+          length += buf.left;
+      }
+    catch (L4virtio::Svr::Bad_descriptor const &)
+      {}
+
+    _length = length;
+    return _length;
+  }
+
+  /**
+   * Check whether the packet carries a valid TCP or UDP checksum.
+   *
+   * Verifies the checksum on first use. Only fully checksummed, unsegmented
+   * TCP and UDP packets over IPv4 or IPv6 (without extension headers) are
+   * verified; the Ethernet, IP and UDP headers must be in the first buffer.
+   * All other packets are reported as not valid.
+   */
+  bool checksum_valid()
+  {
+    if (_csum_state == Csum_unchecked)
+      _csum_state = verify_checksum() ? Csum_valid : Csum_invalid;
+
+    return _csum_state == Csum_valid;
+  }
+
+  /**
+   * Get the packet converted for guests without checksum or segmentation
+   * offloads, see Sw_offload.
+   *
+   * The packet is converted on first use and shared by all destinations.
+   *
+   * \retval nullptr  The packet cannot be converted and shall be dropped.
+   */
+  Sw_offload::Frames const *sw_frames()
+  {
+    if (!_sw_frames)
+      {
+        _sw_frames.reset(new Sw_offload::Frames());
+        std::vector<l4_uint8_t> pkt;
+        pkt.reserve(length());
+        if (   !copy_out(0, &pkt)
+            || !Sw_offload::convert(*_header, std::move(pkt),
+                                    _sw_frames.get()))
+          {
+            Dbg(Dbg::Request, Dbg::Debug)
+              .printf("Dropping packet with invalid offload request\n");
+            _sw_frames->frames.clear();
+          }
+      }
+
+    return _sw_frames->frames.empty() ? nullptr : _sw_frames.get();
+  }
+
+  /**
+   * Append the packet to a contiguous buffer.
+   *
+   * \param      offset  Offset of the first byte of the packet to copy.
+   * \param[out] out     Buffer the packet is appended to.
+   *
+   * \retval true   The packet was copied.
+   * \retval false  The descriptor chain of the request is broken.
+   */
+  bool copy_out(l4_uint32_t offset, std::vector<l4_uint8_t> *out)
+  {
+    L4virtio::Svr::Request_processor req_proc = _req_proc;
+    Buffer buf = _pkt;
+    try
+      {
+        do
+          {
+            l4_uint32_t skip = offset < buf.left ? offset : buf.left;
+            out->insert(out->end(), buf.pos + skip, buf.pos + buf.left);
+            offset -= skip;
+          }
+        while (req_proc.next(_dev->mem_info(), &buf));
+      }
+    catch (L4virtio::Svr::Bad_descriptor const &)
+      {
+        return false;
+      }
+
+    return true;
+  }
+
+  /** Check whether the packet is an IPv6 packet. */
+  bool is_ipv6() const
+  {
+    unsigned off = has_vlan() ? 16 : 12;
+    if (!_pkt.pos || _pkt.left < off + 2)
+      return false;
+
+    uint8_t *p = reinterpret_cast<uint8_t*>(_pkt.pos);
+    return p[off] == 0x86U && p[off + 1] == 0xddU;
+  }
+
   L4virtio::Svr::Request_processor const &get_request_processor() const
   { return _req_proc; }
 
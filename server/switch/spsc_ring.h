@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2024 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <atomic>
+
+/**
+ * \ingroup virtio_net_switch
+ * \{
+ */
+
+/**
+ * Bounded lock-free ring for exactly one producer and one consumer thread.
+ *
+ * \tparam T     Type of the ring elements.
+ * \tparam Size  Capacity of the ring, must be a power of 2.
+ *
+ * `push()` must only be called by the producer thread, `pop()` only by the
+ * consumer thread. Producer and consumer indices live on separate cache lines
+ * to avoid false sharing between the two threads.
+ */
+template<typename T, unsigned Size>
+class Spsc_ring
+{
+  static_assert(Size && (Size & (Size - 1)) == 0,
+                "Ring size must be a power of 2");
+
+public:
+  /**
+   * Append an element to the ring (producer only).
+   *
+   * \retval true   The element was added.
+   * \retval false  The ring is full.
+   */
+  bool push(T const &item)
+  {
+    unsigned head = _head.load(std::memory_order_relaxed);
+    if (head - _tail.load(std::memory_order_acquire) == Size)
+      return false;
+
+    _items[head & (Size - 1)] = item;
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Remove the oldest element from the ring (consumer only).
+   *
+   * \param[out] item  The removed element.
+   *
+   * \retval true   An element was removed.
+   * \retval false  The ring is empty.
+   */
+  bool pop(T *item)
+  {
+    unsigned tail = _tail.load(std::memory_order_relaxed);
+    if (tail == _head.load(std::memory_order_acquire))
+      return false;
+
+    *item = _items[tail & (Size - 1)];
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /** Check whether the ring is empty. */
+  bool empty() const
+  {
+    return   _head.load(std::memory_order_acquire)
+          == _tail.load(std::memory_order_acquire);
+  }
+
+private:
+  alignas(64) std::atomic<unsigned> _head{0}; ///< written by the producer
+  alignas(64) std::atomic<unsigned> _tail{0}; ///< written by the consumer
+  T _items[Size];
+};
+/**\}*/
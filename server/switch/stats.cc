@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2024 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#include <l4/re/env>
+#include <l4/re/error_helper>
+#include <l4/re/mem_alloc>
+
+#include <cstring>
+
+#include "stats.h"
+
+L4Re::Util::Unique_cap<L4Re::Dataspace> Statistics::_ds;
+L4Re::Rm::Unique_region<Switch_statistics *> Statistics::_region;
+Switch_statistics *Statistics::_stats;
+
+#ifdef CONFIG_VNS_STAGE_TIMING
+thread_local Stage_statistics *Stage_timer::_stages;
+#endif
+
+Port_statistics *
+Statistics::alloc_port(char const *name)
+{
+  if (!_stats)
+    return nullptr;
+
+  for (auto &port : _stats->ports)
+    if (!(port.flags & Port_statistics::In_use))
+      {
+        memset(&port, 0, sizeof(port));
+        strncpy(port.name, name, sizeof(port.name) - 1);
+        port.flags = Port_statistics::In_use;
+        return &port;
+      }
+
+  return nullptr;
+}
+
+void
+Statistics::init()
+{
+  auto const *e = L4Re::Env::env();
+  l4_size_t size = l4_round_page(sizeof(Switch_statistics));
+
+  _ds = L4Re::chkcap(L4Re::Util::make_unique_cap<L4Re::Dataspace>(),
+                     "Allocate statistics dataspace capability.");
+  L4Re::chksys(e->mem_alloc()->alloc(size, _ds.get()),
+               "Allocate statistics dataspace.");
+  L4Re::chksys(e->rm()->attach(&_region, size,
+                               L4Re::Rm::F::Search_addr | L4Re::Rm::F::RW,
+                               L4::Ipc::make_cap_rw(_ds.get())),
+               "Attach statistics dataspace.");
+
+  _stats = _region.get();
+  memset(_stats, 0, sizeof(*_stats));
+  _stats->magic = Switch_statistics::Magic;
+  _stats->version = Switch_statistics::Version;
+#ifdef CONFIG_VNS_STAGE_TIMING
+  _stats->stage_timing = 1;
+#endif
+
+  // Statistics::init() runs in the server thread.
+  Stage_timer::set_thread_stages(_stats->server_stages);
+}
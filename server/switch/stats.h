@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2024 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <l4/bid_config.h>
+#include <l4/re/dataspace>
+#include <l4/re/rm>
+#include <l4/re/util/unique_cap>
+#include <l4/sys/types.h>
+#include <l4/util/rdtsc.h>
+
+/**
+ * \ingroup virtio_net_switch
+ * \{
+ */
+
+/**
+ * Stages of the forwarding pipeline measured with CONFIG_VNS_STAGE_TIMING.
+ */
+enum Stage : unsigned
+{
+  Stage_parse,    ///< Fetching and parsing a request from a transmit queue
+  Stage_learn,    ///< Learning the source MAC address
+  Stage_lookup,   ///< Looking up the destination MAC address
+  Stage_copy,     ///< Copying a packet into a receive queue
+  Stage_publish,  ///< Publishing used ring entries and notifying guests
+  Num_stages
+};
+
+/**
+ * Cycles spent in one pipeline stage by one thread.
+ *
+ * Cycles are counted with the time stamp counter (TSC) on x86 and the
+ * virtual counter (CNTVCT) on Arm.
+ */
+struct Stage_statistics
+{
+  enum : unsigned { Histogram_buckets = 16 };
+
+  l4_uint64_t samples;  ///< Number of measurements
+  l4_uint64_t cycles;   ///< Sum of all measurements
+  /**
+   * Measurements by order of magnitude. Bucket 0 counts measurements below
+   * 64 cycles, bucket i measurements in [2^(i+5), 2^(i+6)). The last bucket
+   * also counts all larger measurements.
+   */
+  l4_uint64_t histogram[Histogram_buckets];
+};
+
+/**
+ * Statistics of one copy worker thread.
+ *
+ * Each counter is only written by the worker thread itself.
+ */
+struct Worker_statistics
+{
+  l4_uint64_t jobs;          ///< Transfers executed by the worker
+  l4_uint64_t services;      ///< Port queues served (one burst each)
+  l4_uint64_t steals;        ///< Port queues stolen from other workers
+  l4_uint64_t sleeps;        ///< Times the worker ran out of work
+  l4_uint64_t max_backlog;   ///< Maximum number of port queues waiting
+  /// Transfers to ports that prefer another CPU than the one of the worker.
+  l4_uint64_t remote_jobs;
+  /// CPU the worker is pinned to, Worker_statistics::No_cpu if not pinned.
+  l4_uint32_t cpu;
+  l4_uint32_t reserved;
+  /// Pipeline stages executed by the worker (CONFIG_VNS_STAGE_TIMING).
+  Stage_statistics stages[Num_stages];
+
+  enum : l4_uint32_t { No_cpu = ~0U };
+};
+
+/**
+ * Statistics of one port.
+ *
+ * Each counter is only written by the server thread, except for
+ * `copy_cycles` which the copy workers update with relaxed atomic additions.
+ */
+struct Port_statistics
+{
+  enum : l4_uint32_t
+  {
+    In_use = 1,          ///< The slot belongs to an existing port
+    Rx_quarantined = 2,  ///< The receive queue of the port is quarantined
+  };
+
+  char name[20];         ///< Name of the port
+  l4_uint32_t flags;     ///< Combination of the flags above
+  l4_uint32_t bridge;    ///< Bridge domain of the port
+  l4_uint32_t reserved;
+  l4_uint64_t quarantines;      ///< Times the port was quarantined
+  /// Packets dropped because the port was quarantined, incl. pending ones.
+  l4_uint64_t quarantine_drops;
+  /**
+   * Cycles the server thread spent processing the transmit queue of the port,
+   * excluding packets it copied to the destinations itself.
+   */
+  l4_uint64_t tx_cycles;
+  /// Cycles spent copying packets into the receive queue of the port.
+  l4_uint64_t copy_cycles;
+  /// Source addresses not learned due to the port security of the port.
+  l4_uint64_t learn_refused;
+  /// Packets dropped due to the port security of the port.
+  l4_uint64_t security_drops;
+  /// MAC addresses that started flapping to the port.
+  l4_uint64_t mac_flaps;
+  /// Packets dropped because the port was blocked after a MAC flap.
+  l4_uint64_t flap_drops;
+  /// Packets to the port held because the gate of their class was closed.
+  l4_uint64_t gate_holds;
+  /// Packets to the port held by the egress shaper of the port.
+  l4_uint64_t shaper_holds;
+  /// Packets the port transmitted into the switch.
+  l4_uint64_t tx_packets;
+  /// Transmitted packets flooded as broadcast or unknown unicast.
+  l4_uint64_t tx_floods;
+  /// Transmitted unicast packets whose destination was in the MAC table.
+  l4_uint64_t mac_hits;
+  /// Transmitted unicast packets whose destination was unknown.
+  l4_uint64_t mac_misses;
+  /// Times the port was blocked because a loop was detected.
+  l4_uint64_t loop_blocks;
+  /// Packets from and to the port dropped while blocked after a loop.
+  l4_uint64_t loop_drops;
+  /// Packets to the port whose checksum the switch verified.
+  l4_uint64_t csum_validated;
+  /// Packets to the port whose checksum or segmentation the switch did.
+  l4_uint64_t sw_offloads;
+  /// TCP segments to the port merged into a preceding segment.
+  l4_uint64_t gro_merged;
+  /// Guest memory regions the switch mapped for the port.
+  l4_uint64_t mem_regions;
+  /**
+   * Guest memory regions of the port whose placement allows superpages and
+   * whose mappings the switch requested successfully.
+   */
+  l4_uint64_t mem_superpage_regions;
+
+  /** Account TX cycles (server thread only). */
+  void add_tx_cycles(l4_uint64_t cycles)
+  { tx_cycles += cycles; }
+
+  /** Account copy cycles (any thread). */
+  void add_copy_cycles(l4_uint64_t cycles)
+  { __atomic_fetch_add(&copy_cycles, cycles, __ATOMIC_RELAXED); }
+
+  /** Get the cycles consumed on behalf of the port so far (any thread). */
+  l4_uint64_t cycles() const
+  {
+    return __atomic_load_n(&tx_cycles, __ATOMIC_RELAXED)
+           + __atomic_load_n(&copy_cycles, __ATOMIC_RELAXED);
+  }
+};
+
+/**
+ * Layout of the statistics dataspace.
+ *
+ * The dataspace can be obtained read-only from the switch factory (object
+ * type 1). All counters increase monotonically.
+ */
+struct Switch_statistics
+{
+  enum : l4_uint32_t
+  {
+    Magic = 0x53544154, // "TATS"
+    Version = 15,
+    Max_workers = 64,
+    Max_ports = 256,
+  };
+
+  l4_uint32_t magic;
+  l4_uint32_t version;
+  l4_uint32_t num_workers;
+  /// Set if the switch was built with CONFIG_VNS_STAGE_TIMING.
+  l4_uint32_t stage_timing;
+
+  /// Idle workers woken up because the worker of a port queue was busy.
+  l4_uint64_t steal_wakeups;
+
+  /// Pipeline stages executed by the server thread (CONFIG_VNS_STAGE_TIMING).
+  Stage_statistics server_stages[Num_stages];
+
+  Worker_statistics workers[Max_workers];
+
+  /// Port slots, ports beyond Max_ports are not accounted.
+  Port_statistics ports[Max_ports];
+};
+
+/**
+ * Owner of the statistics dataspace.
+ */
+class Statistics
+{
+public:
+  /** Allocate and attach the statistics dataspace. */
+  static void init();
+
+  /** Get the statistics, valid after `init()`. */
+  static Switch_statistics *get()
+  { return _stats; }
+
+  /** Get the statistics dataspace, valid after `init()`. */
+  static L4::Cap<L4Re::Dataspace> ds()
+  { return _ds.get(); }
+
+  /**
+   * Allocate the statistics slot of a new port.
+   *
+   * \param name  Name of the port.
+   *
+   * \retval nullptr  All slots are in use.
+   * \retval other    The cleared slot of the port.
+   */
+  static Port_statistics *alloc_port(char const *name);
+
+  /** Release the statistics slot of a deleted port. */
+  static void free_port(Port_statistics *port)
+  { port->flags = 0; }
+
+private:
+  static L4Re::Util::Unique_cap<L4Re::Dataspace> _ds;
+  static L4Re::Rm::Unique_region<Switch_statistics *> _region;
+  static Switch_statistics *_stats;
+};
+
+#ifdef CONFIG_VNS_STAGE_TIMING
+/**
+ * Measure the cycles spent in a pipeline stage.
+ *
+ * The measurement starts on construction and ends on `stop()` or on
+ * destruction. It is accounted to the stage statistics of the calling
+ * thread, so every counter has a single writer.
+ */
+class Stage_timer
+{
+public:
+  explicit Stage_timer(Stage stage) : _stage{stage}, _start{l4_rdtsc()} {}
+
+  ~Stage_timer()
+  { stop(); }
+
+  /** End the measurement. */
+  void stop()
+  {
+    if (!_running || !_stages)
+      return;
+
+    l4_uint64_t cycles = l4_rdtsc() - _start;
+    _running = false;
+
+    unsigned bucket = 0;
+    for (l4_uint64_t c = cycles >> 6;
+         c && bucket < Stage_statistics::Histogram_buckets - 1; c >>= 1)
+      ++bucket;
+
+    Stage_statistics *s = &_stages[_stage];
+    ++s->samples;
+    s->cycles += cycles;
+    ++s->histogram[bucket];
+  }
+
+  /** Drop the measurement, e.g. if there was no work to measure. */
+  void discard()
+  { _running = false; }
+
+  /**
+   * Select the statistics the calling thread accounts its stages to.
+   *
+   * \param stages  Array of Num_stages stage statistics.
+   */
+  static void set_thread_stages(Stage_statistics *stages)
+  { _stages = stages; }
+
+private:
+  Stage _stage;
+  bool _running = true;
+  l4_uint64_t _start;
+  static thread_local Stage_statistics *_stages;
+};
+#else
+class Stage_timer
+{
+public:
+  explicit Stage_timer(Stage) {}
+  void stop() {}
+  void discard() {}
+  static void set_thread_stages(Stage_statistics *) {}
+};
+#endif
+/**\}*/
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2024 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <l4/sys/types.h>
+
+#include <cstring>
+#include <vector>
+
+#include "checksum.h"
+#include "virtio_net.h"
+
+/**
+ * \ingroup virtio_net_switch
+ * \{
+ */
+
+/**
+ * Offloads of a sending guest done in software for a receiving guest.
+ *
+ * A guest that negotiated VIRTIO_NET_F_CSUM or VIRTIO_NET_F_HOST_USO sends
+ * packets with an incomplete checksum or UDP datagrams larger than the MTU.
+ * Receivers that did not negotiate the corresponding guest feature get the
+ * packet with the checksum completed or split into datagrams instead.
+ */
+class Sw_offload
+{
+public:
+  /** Packets to deliver instead of the original one. */
+  struct Frames
+  {
+    /// Header of all frames: checksums complete, no segmentation.
+    Virtio_net::Hdr hdr = {};
+    std::vector<std::vector<l4_uint8_t>> frames;
+  };
+
+  /**
+   * Complete the checksum or segment a packet.
+   *
+   * \param      hdr  Virtio-net header of the packet.
+   * \param      pkt  The complete packet.
+   * \param[out] out  Frames to deliver instead of the packet.
+   *
+   * \retval true   The frames were created.
+   * \retval false  The packet is malformed.
+   */
+  static bool convert(Virtio_net::Hdr const &hdr,
+                      std::vector<l4_uint8_t> &&pkt, Frames *out)
+  {
+    if (!hdr.flags.need_csum())
+      return false;
+
+    l4_uint32_t l4_off = hdr.csum_start;
+    l4_uint32_t csum_pos = l4_off + hdr.csum_offset;
+    if (csum_pos + 2 > pkt.size())
+      return false;
+
+    if (hdr.gso_type == Virtio_net::Hdr::Gso_none)
+      {
+        bool udp = hdr.csum_offset == Udp_csum_offset;
+        store_csum(pkt.data() + csum_pos, pkt.data() + l4_off,
+                   pkt.size() - l4_off, udp);
+        out->frames.push_back(std::move(pkt));
+        return true;
+      }
+
+    if (hdr.gso_type == Virtio_net::Hdr::Gso_udp_l4)
+      return segment_udp(hdr, pkt, out);
+
+    return false;
+  }
+
+private:
+  enum : l4_uint32_t
+  {
+    Udp_hdr_len = 8,
+    Udp_csum_offset = 6,
+    /// Maximum number of datagrams per packet, like UDP_MAX_SEGMENTS of Linux
+    Max_segments = 128,
+  };
+
+  /**
+   * Compute the checksum of a range and store it.
+   *
+   * The checksum field must contain the sum of the pseudo header or 0.
+   */
+  static void store_csum(l4_uint8_t *field, l4_uint8_t const *data,
+                         l4_size_t len, bool udp)
+  {
+    Inet_checksum csum;
+    csum.add(data, len);
+    l4_uint16_t result = csum.result();
+    // A UDP checksum of 0 means none was computed.
+    if (udp && !result)
+      result = 0xffff;
+    memcpy(field, &result, sizeof(result));
+  }
+
+  static void put_be16(l4_uint8_t *p, l4_uint16_t value)
+  {
+    p[0] = value >> 8;
+    p[1] = value & 0xff;
+  }
+
+  /**
+   * Split a UDP GSO packet into datagrams of `gso_size` payload bytes.
+   */
+  static bool segment_udp(Virtio_net::Hdr const &hdr,
+                          std::vector<l4_uint8_t> const &pkt, Frames *out)
+  {
+    l4_uint8_t const *p = pkt.data();
+    l4_uint32_t l3_off = 12;
+    if (pkt.size() < l3_off + 2)
+      return false;
+    if (p[l3_off] == 0x81 && p[l3_off + 1] == 0x00)
+      l3_off += 4;
+    if (pkt.size() < l3_off + 2)
+      return false;
+
+    bool ipv4 = p[l3_off] == 0x08 && p[l3_off + 1] == 0x00;
+    bool ipv6 = p[l3_off] == 0x86 && p[l3_off + 1] == 0xdd;
+    l3_off += 2;
+
+    l4_uint32_t l4_off = hdr.csum_start;
+    l4_uint32_t hdr_len = l4_off + Udp_hdr_len;
+    if (   !(ipv4 || ipv6) || !hdr.gso_size
+        || hdr.csum_offset != Udp_csum_offset
+        || l4_off < l3_off + (ipv4 ? 20 : 40) || pkt.size() <= hdr_len)
+      return false;
+
+    l4_uint8_t const *ip = p + l3_off;
+    if (ipv4 ? (ip[0] >> 4) != 4 || ip[9] != 17 : (ip[0] >> 4) != 6)
+      return false;
+
+    // The IPv4 header checksum covers the options, which have to end before
+    // the UDP header.
+    l4_uint32_t ihl = (ip[0] & 0xfU) * 4;
+    if (ipv4 && (ihl < 20 || l3_off + ihl > l4_off))
+      return false;
+
+    l4_uint16_t ip_id = (l4_uint16_t)ip[4] << 8 | ip[5];
+    l4_uint32_t payload = pkt.size() - hdr_len;
+    // Bound the work a single packet causes for every receiver.
+    if ((payload + hdr.gso_size - 1) / hdr.gso_size > Max_segments)
+      return false;
+
+    for (l4_uint32_t pos = 0, i = 0; pos < payload; pos += hdr.gso_size, ++i)
+      {
+        l4_uint32_t chunk = payload - pos < hdr.gso_size
+                            ? payload - pos : hdr.gso_size;
+        std::vector<l4_uint8_t> seg(p, p + hdr_len);
+        seg.insert(seg.end(), p + hdr_len + pos, p + hdr_len + pos + chunk);
+
+        l4_uint8_t *sip = seg.data() + l3_off;
+        l4_uint8_t *udp = seg.data() + l4_off;
+        l4_uint16_t udp_len = Udp_hdr_len + chunk;
+        Inet_checksum pseudo;
+        if (ipv4)
+          {
+            put_be16(sip + 2, seg.size() - l3_off);
+            put_be16(sip + 4, ip_id + i);
+            put_be16(sip + 10, 0);
+            store_csum(sip + 10, sip, ihl, false);
+            pseudo.add(sip + 12, 8);
+          }
+        else
+          {
+            put_be16(sip + 4, seg.size() - l3_off - 40);
+            pseudo.add(sip + 8, 32);
+          }
+
+        put_be16(udp + 4, udp_len);
+        pseudo.add_u16(17);
+        pseudo.add_u16(udp_len);
+        // Seed the checksum field with the pseudo header like a sender
+        // requesting checksum offloading.
+        l4_uint16_t seed = ~pseudo.result();
+        memcpy(udp + Udp_csum_offset, &seed, sizeof(seed));
+        store_csum(udp + Udp_csum_offset, udp, udp_len, true);
+
+        out->frames.push_back(std::move(seg));
+      }
+
+    return true;
+  }
+};
+
+/**\}*/
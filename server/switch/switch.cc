@@ -10,11 +10,68 @@
 #include "switch.h"
 #include "filter.h"
 
-Virtio_switch::Virtio_switch(unsigned max_ports)
+#include <algorithm>
+
+thread_local l4_uint64_t Virtio_net_transfer::_thread_copy_cycles;
+
+Virtio_switch::Virtio_switch(unsigned max_ports, unsigned bridge,
+                             bool wire_mode)
 : _max_ports{max_ports},
-  _max_used{0}
+  _max_used{0},
+  _bridge{bridge},
+  _wire_mode{wire_mode}
 {
   _ports = new Virtio_port *[max_ports]();
+
+  // Guests see probe nonces, but never the key.
+  _probe_key[0] = l4_rdtsc() ^ reinterpret_cast<l4_addr_t>(this);
+  _probe_key[1] = Loop_probe::compute_nonce(_probe_key, l4_rdtsc(),
+                                            l4_kip_clock(l4re_kip()));
+}
+
+void
+Virtio_switch::update_flood_sets()
+{
+  for (unsigned idx = 0; idx < _max_used; ++idx)
+    {
+      Virtio_port *port = _ports[idx];
+      if (!port)
+        continue;
+
+      auto &flood_set = port->flood_set();
+      flood_set.clear();
+      for (unsigned i = 0; i < _max_used; ++i)
+        if (   _ports[i] && _ports[i] != port && port->may_reach(_ports[i])
+            && !_ports[i]->rx_quarantined())
+          flood_set.push_back(_ports[i]);
+    }
+}
+
+void
+Virtio_switch::set_copy_pool(Copy_pool *pool)
+{
+  _copy_pool = pool;
+  // The receive queues belong to the copy workers now.
+  _kick_queues = Virtio_net::Tx_queue;
+}
+
+void
+Virtio_switch::assign_copy_queue(Virtio_port *port)
+{
+  if (_copy_pool)
+    port->set_copy_queue(_copy_pool->create_queue(port->cpu()));
+}
+
+void
+Virtio_switch::delete_port(Virtio_port *port)
+{
+  if (_copy_pool)
+    _copy_pool->release_queue(port->copy_queue());
+
+  if (port->irq_pending())
+    _irq_ports.erase(std::find(_irq_ports.begin(), _irq_ports.end(), port));
+
+  delete(port);
 }
 
 int
@@ -49,15 +106,73 @@ Virtio_switch::add_port(Virtio_port *port)
   if (_max_used == uidx)
     ++_max_used;
 
+  port->stats()->bridge = _bridge;
+  update_flood_sets();
+  assign_copy_queue(port);
+  learn_preloaded_macs(port);
+
   return true;
 }
 
+void
+Virtio_switch::set_mac_flap_dampening(unsigned limit, unsigned hold_ms,
+                                      bool block)
+{
+  _flap_hold = hold_ms * 1000ULL;
+  _flap_block = block;
+  _mac_table.set_flap_dampening(limit, _flap_hold);
+}
+
+void
+Virtio_switch::learn_preloaded_macs(Virtio_port *port)
+{
+  auto iter = _preloaded_macs.begin();
+  while (iter != _preloaded_macs.end())
+    {
+      if (   iter->vlan == port->get_vlan()
+          && Mac_snapshot::matches(*iter, port->get_name()))
+        {
+          _mac_table.learn(Mac_addr(iter->mac), port);
+          iter = _preloaded_macs.erase(iter);
+        }
+      else
+        ++iter;
+    }
+}
+
+void
+Virtio_switch::preload_mac_table(Mac_snapshot const *snapshot)
+{
+  snapshot->for_each([this](Mac_snapshot::Entry const &e)
+                     {
+                       if (e.bridge == _bridge)
+                         _preloaded_macs.push_back(e);
+                     });
+
+  Dbg(Dbg::Core, Dbg::Info)
+    .printf("Bridge %u: preloaded %zu MAC addresses from snapshot\n",
+            _bridge, _preloaded_macs.size());
+}
+
+void
+Virtio_switch::store_mac_table(Mac_snapshot *snapshot) const
+{
+  _mac_table.for_each([this, snapshot](Mac_addr addr, Virtio_port *port)
+                      { snapshot->add(addr, _bridge, port->get_vlan(),
+                                      port->get_name()); });
+
+  // Keep entries of ports that did not reconnect since the last restart.
+  for (auto const &e : _preloaded_macs)
+    snapshot->add(Mac_addr(e.mac), _bridge, e.vlan, e.port_name);
+}
+
 bool
 Virtio_switch::add_monitor_port(Virtio_port *port)
 {
   if (!_monitor)
     {
       _monitor = port;
+      assign_copy_queue(port);
       return true;
     }
 
@@ -70,6 +185,12 @@ Virtio_switch::add_monitor_port(Virtio_port *port)
 void
 Virtio_switch::check_ports()
 {
+  bool removed = false;
+
+  // Ports must not be deleted while copy workers still access them.
+  if (_copy_pool)
+    _copy_pool->drain();
+
   for (unsigned idx = 0; idx < _max_used; ++idx)
     {
       Virtio_port *port = _ports[idx];
@@ -83,14 +204,18 @@ Virtio_switch::check_ports()
             --_max_used;
 
           _mac_table.flush(port);
-          delete(port);
+          delete_port(port);
+          removed = true;
         }
     }
 
+  if (removed)
+    update_flood_sets();
+
   if (   _monitor && _monitor->obj_cap()
       && !_monitor->obj_cap().validate().label())
     {
-      delete(_monitor);
+      delete_port(_monitor);
       _monitor = nullptr;
     }
 }
@@ -98,25 +223,78 @@ Virtio_switch::check_ports()
 void
 Virtio_switch::handle_tx_queue(Virtio_port *port)
 {
+  Stage_timer parse(Stage_parse);
   auto request = port->get_tx_request();
   if (!request)
+    {
+      parse.discard();
+      return;
+    }
+  parse.stop();
+
+  Port_statistics *stats = port->stats();
+  ++stats->tx_packets;
+
+  if (L4_UNLIKELY(port->loop_detect()) && handle_loop_probe(port, request.get()))
     return;
 
+  if (L4_UNLIKELY(port->loop_blocked()))
+    {
+      ++stats->loop_drops;
+      return;
+    }
+
+  // Dropping the request finishes it right away.
+  if (L4_UNLIKELY(port->tx_blocked()))
+    {
+      ++stats->flap_drops;
+      return;
+    }
+
   Mac_addr src = request->src_mac();
-  _mac_table.learn(src, port);
+  {
+    Stage_timer learn(Stage_learn);
+    switch (_mac_table.learn(src, port))
+      {
+      case Mac_table<>::Learn_result::Learned:
+      case Mac_table<>::Learn_result::Held:
+        break;
+      case Mac_table<>::Learn_result::Flap:
+        ++stats->mac_flaps;
+        if (_flap_block)
+          {
+            port->block_tx(l4_kip_clock(l4re_kip()) + _flap_hold);
+            ++stats->flap_drops;
+            return;
+          }
+        break;
+      case Mac_table<>::Learn_result::Refused:
+        ++stats->learn_refused;
+        break;
+      case Mac_table<>::Learn_result::Violation:
+        ++stats->security_drops;
+        return;
+      }
+  }
 
   auto dst = request->dst_mac();
   bool is_broadcast = dst.is_broadcast();
   uint16_t vlan = request->has_vlan() ? request->vlan_id() : port->get_vlan();
   if (L4_LIKELY(!is_broadcast))
     {
+      Stage_timer lookup(Stage_lookup);
       auto *target = _mac_table.lookup(dst);
+      lookup.stop();
       if (target)
         {
           // Do not send packets to the port they came in; they might
           // be sent to us by another switch which does not know how
           // to reach the target.
-          if (target != port && target->match_vlan(vlan))
+          if (target == port)
+            return;
+
+          ++stats->mac_hits;
+          if (target->match_vlan(vlan) && port->may_reach(target))
             {
               target->handle_request(port, request);
               if (_monitor && !filter_request(request.get()))
@@ -124,16 +302,15 @@ Virtio_switch::handle_tx_queue(Virtio_port *port)
             }
           return;
         }
+      ++stats->mac_misses;
     }
 
   // It is either a broadcast or an unknown destination - send to all
-  // known ports except the source port
-  for (unsigned idx = 0; idx < _max_used && _ports[idx]; ++idx)
-    {
-      auto *target = _ports[idx];
-      if (target != port && target->match_vlan(vlan))
-        target->handle_request(port, request);
-    }
+  // known ports the source port may reach
+  ++stats->tx_floods;
+  for (auto *target : port->flood_set())
+    if (target->match_vlan(vlan))
+      target->handle_request(port, request);
 
   // Send a copy to the monitor port
   if (_monitor && !filter_request(request.get()))
@@ -141,38 +318,220 @@ Virtio_switch::handle_tx_queue(Virtio_port *port)
 }
 
 void
-Virtio_switch::handle_port_irq(Virtio_port *port)
+Virtio_switch::handle_tx_queue_wire(Virtio_port *port)
 {
-  /* handle IRQ on one port for the time being */
-  if (!port->tx_work_pending() && !port->rx_work_pending())
-    Dbg(Dbg::Port, Dbg::Info)
-      .printf("Port %s: Irq without pending work\n", port->get_name());
+  // There are at most two ports in wire mode, the peer is the other one.
+  Virtio_port *peer = _ports[0] == port ? _ports[1] : _ports[0];
 
-  do
+  while (port->tx_work_pending())
     {
-      port->tx_q()->disable_notify();
-      port->rx_q()->disable_notify();
+      Stage_timer parse(Stage_parse);
+      auto request = port->get_tx_request();
+      if (!request)
+        {
+          parse.discard();
+          continue;
+        }
+      parse.stop();
+
+      ++port->stats()->tx_packets;
+
+      // Without a peer the request is dropped (and finished) right away.
+      if (L4_LIKELY(peer != nullptr))
+        peer->handle_request(port, request);
+
+      if (_monitor && !filter_request(request.get()))
+        _monitor->handle_request(port, request);
+    }
+}
+
+bool
+Virtio_switch::handle_loop_probe(Virtio_port *port,
+                                 Virtio_net_request const *request)
+{
+  auto const *probe = Loop_probe::from_packet(request->first_buffer());
+  if (!probe)
+    return false;
+
+  // A probe of another bridge domain crossed a guest bridging two domains,
+  // which is no loop by itself.
+  if (probe->bridge != _bridge)
+    return true;
+
+  unsigned slot = 0;
+  while (slot < _max_used && _ports[slot] != port)
+    ++slot;
+
+  // The switch never sends a frame back to its ingress port, so a probe
+  // returning on the port it was sent to is reflected by the guest or looped
+  // outside the switch. A probe of a port deleted since is stale.
+  if (   probe->port == slot || probe->port >= _max_used
+      || !_ports[probe->port])
+    return true;
+
+  // Only the switch knows the nonces of the probes. A probe may return after
+  // the next round started.
+  if (   probe->nonce != probe_nonce(probe->port, _probe_round[0])
+      && probe->nonce != probe_nonce(probe->port, _probe_round[1]))
+    {
+      Dbg(Dbg::Port, Dbg::Info)
+        .printf("Port %s: dropping loop probe with invalid nonce\n",
+                port->get_name());
+      return true;
+    }
+
+  // Of the two ports the probe passed, always block the one in the higher
+  // slot, so both directions of a loop block the same port.
+  Virtio_port *sender = _ports[probe->port];
+  Virtio_port *blocked = probe->port > slot ? sender : port;
+
+  if (!blocked->loop_blocked())
+    {
+      Dbg(Dbg::Port, Dbg::Warn)
+        .printf("Loop detected: probe sent to port %s came back on port %s."
+                " Blocking port %s\n",
+                sender->get_name(), port->get_name(), blocked->get_name());
+      ++blocked->stats()->loop_blocks;
+    }
+
+  blocked->block_loop(l4_kip_clock(l4re_kip()) + _loop_hold);
+  return true;
+}
+
+bool
+Virtio_switch::send_loop_probes()
+{
+  // The round secret mixes the time of the round into the nonces, so they
+  // differ from round to round.
+  _probe_round[1] = _probe_round[0];
+  _probe_round[0] = probe_nonce(l4_rdtsc(), _probe_round[1]);
+
+  bool sent = false;
+  for (unsigned idx = 0; idx < _max_used; ++idx)
+    if (_ports[idx] && _ports[idx]->loop_detect())
+      {
+        _ports[idx]->send_loop_probe(_bridge, idx,
+                                     probe_nonce(idx, _probe_round[0]));
+        sent = true;
+      }
+
+  return sent;
+}
+
+void
+Virtio_switch::check_rx_stalls(l4_cpu_time_t now, l4_cpu_time_t timeout)
+{
+  bool changed = false;
+  for (unsigned idx = 0; idx < _max_used; ++idx)
+    if (_ports[idx] && _ports[idx]->check_rx_stall(now, timeout))
+      changed = true;
+
+  if (_monitor)
+    _monitor->check_rx_stall(now, timeout);
+
+  if (changed)
+    update_flood_sets();
+}
+
+void
+Virtio_switch::queue_port_irq(Virtio_port *port)
+{
+  if (port->irq_pending())
+    return;
+
+  port->set_irq_pending(true);
+  _irq_ports.push_back(port);
+}
+
+void
+Virtio_switch::handle_port_irqs()
+{
+  bool quarantine_left = false;
+  l4_cpu_time_t now = 0;
+
+  for (Virtio_port *port : _irq_ports)
+    {
+      port->set_irq_pending(false);
+      port->handle_ctrl_queue();
+
+      // A quarantined guest that refilled its receive queue kicks us.
+      if (L4_UNLIKELY(port->rx_quarantined()))
+        {
+          if (!now)
+            now = l4_kip_clock(l4re_kip());
+          if (port->check_rx_stall(now, 0) && port != _monitor)
+            quarantine_left = true;
+        }
+
+      if (!port->tx_work_pending() && !port->rx_work_pending())
+        Dbg(Dbg::Port, Dbg::Info)
+          .printf("Port %s: Irq without pending work\n", port->get_name());
+    }
+
+  if (quarantine_left)
+    update_flood_sets();
+
+  while (!_irq_ports.empty())
+    {
+      for (Virtio_port *port : _irq_ports)
+        {
+          port->tx_q()->disable_notify();
+          port->rx_q()->disable_notify();
+        }
 
       // Within the loop, to trigger before enabling notifications again.
       for (unsigned idx = 0; idx < _max_ports; ++idx)
         if (_ports[idx])
-          _ports[idx]->kick_disable_and_remember();
+          _ports[idx]->kick_disable_and_remember(_kick_queues);
 
-      while (port->tx_work_pending())
-        handle_tx_queue(port);
-      while (port->rx_work_pending())
-        port->handle_rx_queue();
+      for (Virtio_port *port : _irq_ports)
+        {
+          l4_uint64_t start = l4_rdtsc();
+          l4_uint64_t copied = Virtio_net_transfer::thread_copy_cycles();
+          if (_wire_mode)
+            handle_tx_queue_wire(port);
+          else
+            while (port->tx_work_pending())
+              handle_tx_queue(port);
+          // Packets copied by the server thread are already accounted to
+          // their destination ports.
+          copied = Virtio_net_transfer::thread_copy_cycles() - copied;
+          port->stats()->add_tx_cycles(l4_rdtsc() - start - copied);
+
+          while (port->rx_work_pending())
+            port->handle_rx_queue();
+        }
 
+      // Deliver the packets merged in this round before notifying the guests.
       for (unsigned idx = 0; idx < _max_ports; ++idx)
         if (_ports[idx])
-          _ports[idx]->kick_emit_and_enable();
+          _ports[idx]->flush_gro();
+      if (_monitor)
+        _monitor->flush_gro();
+
+      {
+        Stage_timer publish(Stage_publish);
+        for (unsigned idx = 0; idx < _max_ports; ++idx)
+          if (_ports[idx])
+            _ports[idx]->kick_emit_and_enable(_kick_queues);
+      }
 
-      port->tx_q()->enable_notify();
-      port->rx_q()->enable_notify();
+      for (Virtio_port *port : _irq_ports)
+        {
+          port->tx_q()->enable_notify();
+          port->rx_q()->enable_notify();
+        }
 
       L4virtio::wmb();
       L4virtio::rmb();
-    }
-  while (port->tx_work_pending() || port->rx_work_pending());
 
+      // Only ports that got new work meanwhile need another round.
+      _irq_ports.erase(std::remove_if(_irq_ports.begin(), _irq_ports.end(),
+                                      [](Virtio_port *port)
+                                        {
+                                          return !port->tx_work_pending()
+                                                 && !port->rx_work_pending();
+                                        }),
+                       _irq_ports.end());
+    }
 }
@@ -10,6 +10,9 @@
 
 #include "port.h"
 #include "mac_table.h"
+#include "mac_snapshot.h"
+
+#include <vector>
 
 /**
  * \ingroup virtio_net_switch
@@ -34,10 +37,65 @@ private:
 
   unsigned _max_ports;
   unsigned _max_used;
+  unsigned _bridge;
+  bool _wire_mode;
   Mac_table<> _mac_table;
 
+  /** Time in microseconds a flapping MAC address is held. */
+  l4_cpu_time_t _flap_hold = 0;
+  /** Block the TX of ports a MAC address flapped to for `_flap_hold`. */
+  bool _flap_block = false;
+
+  /** Time in microseconds a port stays blocked after a loop, 0 if off. */
+  l4_cpu_time_t _loop_hold = 0;
+  /** Secret key of the loop probe nonces, see Loop_probe::compute_nonce(). */
+  l4_uint64_t _probe_key[2];
+  /** Secrets of the current and the previous probe round. */
+  l4_uint64_t _probe_round[2] = { 0, 0 };
+
+  /** Copy worker threads, nullptr if the pipeline is not split. */
+  Copy_pool *_copy_pool = nullptr;
+  /** Queues whose guest notifications are batched by the server thread. */
+  unsigned _kick_queues = Virtio_net::All_queues;
+
+  /** Ports whose kick IRQ awaits handle_port_irqs(). */
+  std::vector<Virtio_port *> _irq_ports;
+
+  /** MAC addresses from a snapshot whose ports did not connect yet. */
+  std::vector<Mac_snapshot::Entry> _preloaded_macs;
+
   int lookup_free_slot();
 
+  /**
+   * Recompute the flood sets of all ports.
+   *
+   * Must be called whenever a port is added or removed. The flood set of a
+   * port contains all other ports that its isolation type permits to reach.
+   * Ports pruned this way never cost a copy when packets are flooded.
+   */
+  void update_flood_sets();
+
+  /**
+   * Give a new port a copy queue if the pipeline is split.
+   *
+   * \param port  The newly added port.
+   */
+  void assign_copy_queue(Virtio_port *port);
+
+  /**
+   * Delete a port that is gone.
+   *
+   * \param port  The port to delete.
+   */
+  void delete_port(Virtio_port *port);
+
+  /**
+   * Learn the preloaded MAC addresses that belong to a new port.
+   *
+   * \param port  The newly added port.
+   */
+  void learn_preloaded_macs(Virtio_port *port);
+
   /**
    * Deliver the requests from the transmission queue of a specific port.
    *
@@ -49,13 +107,49 @@ private:
    */
   void handle_tx_queue(Virtio_port *port);
 
+  /**
+   * Deliver all requests from the transmission queue of a port in wire mode.
+   *
+   * In wire mode the switch connects exactly two ports. Every request is
+   * passed to the other port without consulting the `_mac_table` and without
+   * any VLAN processing. The monitor port still gets a copy of each request.
+   *
+   * \param port  Port whose transmission queue should be processed.
+   */
+  void handle_tx_queue_wire(Virtio_port *port);
+
+  /**
+   * Check whether a request is a returning loop probe of the switch.
+   *
+   * \param port     Port that sent the request.
+   * \param request  The request.
+   *
+   * \retval true   The request is a probe of the switch and was consumed.
+   *                If it was sent to another port of this bridge domain, a
+   *                loop exists and one of the two ports is blocked.
+   * \retval false  The request shall be forwarded.
+   */
+  bool handle_loop_probe(Virtio_port *port, Virtio_net_request const *request);
+
+  /** Compute a loop probe nonce with the secret key of the switch. */
+  l4_uint64_t probe_nonce(l4_uint64_t port, l4_uint64_t round) const
+  { return Loop_probe::compute_nonce(_probe_key, port, round); }
+
 public:
   /**
    * Create a switch with n ports.
    *
-   * \param max_ports maximal number of provided ports
+   * \param max_ports  maximal number of provided ports
+   * \param bridge     number of the bridge domain implemented by the switch
+   * \param wire_mode  connect two ports point-to-point, bypassing MAC
+   *                   learning, flooding and VLAN handling
    */
-  explicit Virtio_switch(unsigned max_ports);
+  explicit Virtio_switch(unsigned max_ports, unsigned bridge = 0,
+                         bool wire_mode = false);
+
+  /** Get the number of the bridge domain implemented by the switch. */
+  unsigned bridge() const
+  { return _bridge; }
 
   /**
    * Add a port to the switch.
@@ -77,6 +171,50 @@ public:
    */
   bool add_monitor_port(Virtio_port *port);
 
+  /**
+   * Hand the copy operations of the switch to copy worker threads.
+   *
+   * \param pool  Copy workers that execute copy operations to ports.
+   *
+   * The switch splits its pipeline: the server thread classifies packets and
+   * the copy workers copy them into the receive queues. Each port gets its
+   * own copy queue, which idle workers steal from busy ones. Must be called
+   * before any port is added.
+   */
+  void set_copy_pool(Copy_pool *pool);
+
+  /**
+   * Configure the dampening of MAC addresses flapping between ports.
+   *
+   * \param limit    Moves per second after which an address is held on its
+   *                 port, 0 to disable flap detection.
+   * \param hold_ms  Time in milliseconds a flapping address is held.
+   * \param block    Drop all packets from the port an address flapped to
+   *                 while the address is held.
+   */
+  void set_mac_flap_dampening(unsigned limit, unsigned hold_ms, bool block);
+
+  /**
+   * Enable loop detection.
+   *
+   * \param interval_ms  Interval in milliseconds at which send_loop_probes()
+   *                     is called. A port stays blocked for three intervals
+   *                     after the last probe detecting a loop.
+   */
+  void set_loop_detection(unsigned interval_ms)
+  { _loop_hold = 3 * interval_ms * 1000ULL; }
+
+  /**
+   * Send a loop probe to all ports with loop detection.
+   *
+   * Probes are also sent to blocked ports, so they stay blocked as long as
+   * the loop exists.
+   *
+   * \retval true   The switch has ports with loop detection.
+   * \retval false  No port uses loop detection.
+   */
+  bool send_loop_probes();
+
   /**
    * Check validity of ports.
    *
@@ -87,16 +225,61 @@ public:
   void check_ports();
 
   /**
-   * Handle an incoming irq on a given port.
+   * Detect ports whose receive queue stalls.
+   *
+   * \param now      Current time in microseconds (KIP clock).
+   * \param timeout  Time in microseconds requests may be pending without the
+   *                 guest adding buffers to the receive queue.
+   *
+   * Stalled ports are quarantined and removed from the flood sets until
+   * their guest refills the receive queue.
+   */
+  void check_rx_stalls(l4_cpu_time_t now, l4_cpu_time_t timeout);
+
+  /**
+   * Preload the MAC table from a snapshot.
+   *
+   * Only entries of the bridge domain of the switch are considered. They are
+   * learned as soon as a port with a matching
+   * name and VLAN configuration is added to the switch. This way unicast
+   * traffic is not flooded after a restart of the switch.
+   *
+   * \param snapshot  Snapshot of a previous incarnation of the switch.
+   */
+  void preload_mac_table(Mac_snapshot const *snapshot);
+
+  /**
+   * Add the current content of the MAC table to a snapshot.
+   *
+   * \param snapshot  Snapshot being updated, see Mac_snapshot::start().
+   */
+  void store_mac_table(Mac_snapshot *snapshot) const;
+
+  /**
+   * Note an incoming irq on a given port.
    *
    * Virtio_port does not handle irq related stuff by itself. Someone
    * else has to do this and has to handle incoming irqs. This
    * function is supposed to be invoked after an irq related to the
-   * port came in.
+   * port came in. The port is processed by the next handle_port_irqs()
+   * together with all other ports kicked in the meantime.
    *
    * \param port the Virtio_port an irq was triggered on
    */
-  void handle_port_irq(Virtio_port *port);
+  void queue_port_irq(Virtio_port *port);
+
+  /** Check whether kicked ports wait for handle_port_irqs(). */
+  bool port_irqs_pending() const
+  { return !_irq_ports.empty(); }
+
+  /**
+   * Handle all ports kicked since the last call.
+   *
+   * The ports are processed in combined rounds: the guest notifications of
+   * all ports are disabled and emitted once per round instead of once per
+   * kicked port.
+   */
+  void handle_port_irqs();
 
   /**
    * Is there still a free port on this switch available?
@@ -10,6 +10,7 @@
 
 #include "virtio_net.h"
 #include "request.h"
+#include "stats.h"
 #include "vlan.h"
 
 #include <vector>
@@ -17,6 +18,7 @@
 #include <l4/cxx/ipc_timeout_queue>
 
 #include <l4/cxx/ref_ptr>
+#include <l4/cxx/unique_ptr>
 #include <l4/cxx/dlist>
 #include <l4/cxx/pair>
 
@@ -46,6 +48,13 @@ class Virtio_net_transfer :
 public:
   typedef cxx::D_list<Virtio_net_transfer> Pending_list;
 
+  /** A frame built by the switch and owned by its transfer. */
+  struct Local_frame
+  {
+    Virtio_net::Hdr hdr;
+    std::vector<l4_uint8_t> data;
+  };
+
 private:
   /*
    * src description
@@ -58,18 +67,26 @@ private:
    * processor instance, which will be initialized using the current
    * state of the "parent request".
    */
-  /** The associated network request */
+  /** The associated network request, nullptr for frames of the switch */
   Virtio_net_request::Request_ptr _request;
   L4virtio::Svr::Request_processor _src_req_proc;
+  /** Header of the packet */
+  Virtio_net::Hdr const *_src_header;
+  /** The packet is a single local buffer instead of the request buffers */
+  bool _local_frame = false;
 
   /* dst description */
   /** The destination port */
   Virtio_net *_dst_dev;
   /** The Receive queue of the destination port */
   L4virtio::Svr::Virtqueue *_dst_queue;
+  /** Statistics of the destination port, accounting the copy cycles */
+  Port_statistics *_dst_stats;
   L4virtio::Svr::Virtqueue::Head_desc _dst_head;
   L4virtio::Svr::Request_processor _dst_req_proc;
   Virtio_net::Hdr *_dst_header = nullptr;
+  /** First receive buffer used, kept after the transfer finished */
+  void const *_dst_buffer = nullptr;
 
   /* the buffer descriptors used for this transaction and the amount
      of bytes copied to the current target descriptor */
@@ -84,13 +101,23 @@ private:
   l4_uint16_t _num_merged = 0;
 
   Virtio_vlan_mangle _mangle;
+  /** Traffic class of the request at the destination port */
+  l4_uint8_t _traffic_class = 0;
+  /** The switch verified the checksum of the packet */
+  bool _data_valid = false;
+  /** Frame owned by the transfer, if any */
+  cxx::unique_ptr<Local_frame> _owned_frame;
 
   bool next_src_buffer()
-  { return _src_req_proc.next(_request->dev()->mem_info(), &_src); }
+  {
+    return !_local_frame
+           && _src_req_proc.next(_request->dev()->mem_info(), &_src);
+  }
 
   bool next_dst_buffer()
   { return _dst_req_proc.next(_dst_dev->mem_info(), &_dst); }
 
+protected:
   /**
    * Callback for the timeout.
    *
@@ -115,25 +142,130 @@ public:
 
   Virtio_net_transfer(Virtio_net_request::Request_ptr request,
                       Virtio_net *dst_dev, L4virtio::Svr::Virtqueue *dst_queue,
+                      Port_statistics *dst_stats,
                       const Virtio_vlan_mangle &mangle)
   : _request{request},
     _src_req_proc{request->get_request_processor()},
+    _src_header{request->header()},
     _dst_dev{dst_dev},
     _dst_queue{dst_queue},
+    _dst_stats{dst_stats},
     _src{_request->first_buffer()},
     _mangle{mangle}
   {}
 
+  /**
+   * Create a transfer of a frame in a local buffer.
+   *
+   * \param request  Request the frame was derived from, nullptr for frames
+   *                 generated by the switch. The transfer keeps the request
+   *                 alive.
+   * \param header   Header of the frame.
+   * \param frame    The frame in a single buffer. The buffer must stay valid
+   *                 until the transfer is deleted.
+   */
+  Virtio_net_transfer(Virtio_net_request::Request_ptr request,
+                      Virtio_net::Hdr const *header, Buffer const &frame,
+                      Virtio_net *dst_dev, L4virtio::Svr::Virtqueue *dst_queue,
+                      Port_statistics *dst_stats,
+                      const Virtio_vlan_mangle &mangle)
+  : _request{request},
+    _src_header{header},
+    _local_frame{true},
+    _dst_dev{dst_dev},
+    _dst_queue{dst_queue},
+    _dst_stats{dst_stats},
+    _src{frame},
+    _mangle{mangle}
+  {}
+
+  /**
+   * Create a transfer of a frame owned by the transfer.
+   *
+   * \param frame  The frame. The transfer takes over ownership.
+   */
+  Virtio_net_transfer(Local_frame *frame, Virtio_net *dst_dev,
+                      L4virtio::Svr::Virtqueue *dst_queue,
+                      Port_statistics *dst_stats,
+                      const Virtio_vlan_mangle &mangle)
+  : _src_header{&frame->hdr},
+    _local_frame{true},
+    _dst_dev{dst_dev},
+    _dst_queue{dst_queue},
+    _dst_stats{dst_stats},
+    _src{frame->data.data(), static_cast<l4_uint32_t>(frame->data.size())},
+    _mangle{mangle},
+    _owned_frame{frame}
+  {}
+
+  /**
+   * Get the first receive buffer the packet was copied to, nullptr if the
+   * transfer did not start.
+   */
+  void const *dst_buffer() const
+  { return _dst_buffer; }
+
+  /** Get the length of the transferred packet, see Egress_shaper. */
+  l4_uint32_t packet_length() const
+  { return _local_frame ? _src.left : _request->length(); }
+
+  /** Get the traffic class of the transfer, see Gate_control. */
+  l4_uint8_t traffic_class() const
+  { return _traffic_class; }
+
+  /** Set the traffic class of the transfer. */
+  void set_traffic_class(l4_uint8_t tc)
+  { _traffic_class = tc; }
+
+  /** Mark the checksum of the packet as verified for the destination. */
+  void set_data_valid()
+  { _data_valid = true; }
+
+  /**
+   * Check whether the transfer already consumed buffers of the destination.
+   *
+   * A started transfer must be finished with `finish_transfer()` to return the
+   * consumed buffers to the destination port.
+   */
+  bool started() const
+  { return _dst_header != nullptr; }
+
   /**
    * Deliver the request to the destination port
    *
    * \retval true   The request has been delivered to the destination port.
    * \retval false  The request could not be delivered to the destination port.
+   *
+   * The cycles spent are accounted to the destination port, whether the
+   * request could be delivered or not.
    */
   bool transfer()
+  {
+    l4_uint64_t start = l4_rdtsc();
+    bool done = copy_packet();
+    l4_uint64_t cycles = l4_rdtsc() - start;
+    _dst_stats->add_copy_cycles(cycles);
+    _thread_copy_cycles += cycles;
+    return done;
+  }
+
+  /**
+   * Get the cycles the calling thread spent in transfer() so far.
+   *
+   * Lets the server thread keep the copy cycles, which belong to the
+   * destination, out of the cycles it accounts to the source port.
+   */
+  static l4_uint64_t thread_copy_cycles()
+  { return _thread_copy_cycles; }
+
+private:
+  static thread_local l4_uint64_t _thread_copy_cycles;
+
+  bool copy_packet()
   {
     Dbg trace(Dbg::Request, Dbg::Trace, "REQ");
     trace.printf("Transfer: %p\n", this);
+    Stage_timer copy(Stage_copy);
 
     while (!_src.done() || next_src_buffer())
       {
@@ -159,6 +291,7 @@ public:
                   throw L4::Runtime_error(-L4_EINVAL,
                                           "Target buffer too small for header");
                 _dst_header = reinterpret_cast<Virtio_net::Hdr *>(_dst.pos);
+                _dst_buffer = _dst.pos;
                 trace.printf("\t: Copying header to %p (size: %u)\n",
                              _dst.pos, _dst.left);
                 /*
@@ -184,9 +317,11 @@ public:
                  *     segment it now. But again we rely on the
                  *     ability of our guest to handle gso
                  *
-                 * We currently assume that our guests negotiated
-                 * virtio_net_f_guest_*, this needs to be checked in
-                 * the future.
+                 * Only checksum and UDP segmentation offloading are
+                 * offered (with --uso). Packets using them are
+                 * converted by Sw_offload for guests that did not
+                 * negotiate the corresponding virtio_net_f_guest_*
+                 * feature, so they never reach this point.
                  *
                  * We also discussed the usage of
                  * virtio_net_hdr_f_data_valid to remove the need to
@@ -201,10 +336,15 @@ public:
                  * u) we can not signal this without actually
                  * verifying the checksum. Otherwise a packet with an
                  * invalid checksum could be successfully delivered.
+                 * With --validate-csum the switch does verify it (see
+                 * Virtio_net_request::checksum_valid()) and sets the
+                 * flag for guests that negotiated guest_csum.
                  */
                 _total = sizeof(Virtio_net::Hdr);
-                memcpy(_dst_header, _request->header(), _total);
+                memcpy(_dst_header, _src_header, _total);
                 _mangle.rewrite_hdr(_dst_header);
+                if (_data_valid)
+                  _dst_header->flags.data_valid() = true;
                 _dst.skip(_total);
               }
             ++_num_merged;
@@ -213,7 +353,7 @@ public:
         if (!_dst.done() || next_dst_buffer())
           {
             trace.printf("\t: Copying %p#%p:%u (%x) -> %p#%p:%u  (%x)\n",
-                         _request->dev(),
+                         _request ? _request->dev() : nullptr,
                          _src.pos, _src.left, _src.left,
                          _dst_dev, _dst.pos, _dst.left, _dst.left);
 
@@ -228,10 +368,12 @@ public:
             _dst_head = L4virtio::Svr::Virtqueue::Head_desc();
           }
       }
+    copy.stop();
     finish_transfer();
     return true;
   }
 
+public:
   /**
    * Finalize the Request delivery.
    *
@@ -248,6 +390,7 @@ public:
         return;
       }
 
+    Stage_timer publish(Stage_publish);
     if (_consumed.empty())
       {
         assert(_dst_head);
@@ -267,7 +410,7 @@ public:
     _dst_header = nullptr;
   }
 
-  ~Virtio_net_transfer()
+  virtual ~Virtio_net_transfer()
   {
     /*
      * We ended up here after an exception or a timeout, so the
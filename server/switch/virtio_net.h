@@ -18,6 +18,7 @@
 #include <l4/l4virtio/l4virtio>
 
 #include "debug.h"
+#include "virtio_net_buffer.h"
 /**
  * \ingroup virtio_net_switch
  * \{
@@ -49,6 +50,10 @@ public:
     _kick_pending = false;
   }
 
+  /** Get the index of the next available ring entry the driver will add. */
+  l4_uint16_t avail_idx() const
+  { return *const_cast<l4_uint16_t const volatile *>(&_avail->idx); }
+
 private:
   bool _do_kick = true;
   bool _kick_pending = false;
@@ -83,6 +88,14 @@ public:
 
   struct Hdr
   {
+    enum : l4_uint8_t
+    {
+      Gso_none = 0,    ///< Packet needs no segmentation
+      Gso_tcpv4 = 1,   ///< TCP segmentation offload over IPv4
+      Gso_tcpv6 = 4,   ///< TCP segmentation offload over IPv6
+      Gso_udp_l4 = 5,  ///< UDP segmentation offload (USO)
+    };
+
     Hdr_flags flags;
     l4_uint8_t gso_type;
     l4_uint16_t hdr_len;
@@ -120,31 +133,102 @@ public:
     CXX_BITFIELD_MEMBER(23, 23, ctrl_mac_addr, raw); // Set MAC address
   };
 
+  /** Feature bits beyond the first feature word. */
+  enum Feature_bit : unsigned
+  {
+    Feature_guest_uso4 = 54,  ///< Guest handles USO over IPv4 in
+    Feature_guest_uso6 = 55,  ///< Guest handles USO over IPv6 in
+    Feature_host_uso = 56,    ///< Host handles USO
+  };
+
   enum
   {
     Rx = 0,
     Tx = 1,
+    Ctrl = 2,
+  };
+
+  /** Bits of Net_config_space::status. */
+  enum Status : l4_uint16_t
+  {
+    Status_link_up = 1,   ///< The link is up
+    Status_announce = 2,  ///< The guest shall announce itself on the network
+  };
+
+  /** Header of a request on the control queue. */
+  struct Ctrl_hdr
+  {
+    l4_uint8_t cls;
+    l4_uint8_t cmd;
+  };
+
+  /** Buffer of a control request that knows whether the device may write. */
+  struct Ctrl_buffer : Buffer
+  {
+    Ctrl_buffer() = default;
+    Ctrl_buffer(L4virtio::Svr::Driver_mem_region const *r,
+                L4virtio::Svr::Virtqueue::Desc const &d,
+                L4virtio::Svr::Request_processor const *p)
+    : Buffer(r, d, p), writable(d.flags.write())
+    {}
+
+    bool writable = false;
+  };
+
+  enum Ctrl_cmd : l4_uint8_t
+  {
+    Ctrl_announce = 3,      ///< Class of announce commands
+    Ctrl_announce_ack = 0,  ///< Guest announced itself
+  };
+
+  enum Ctrl_ack : l4_uint8_t
+  {
+    Ctrl_ok = 0,
+    Ctrl_err = 1,
+  };
+
+  /** Selection of queues for the kick batching functions. */
+  enum Queue_mask : unsigned
+  {
+    Rx_queue = 1U << Rx,
+    Tx_queue = 1U << Tx,
+    All_queues = Rx_queue | Tx_queue,
   };
 
   struct Net_config_space
   {
     // The config defining mac address (if VIRTIO_NET_F_MAC aka Features::mac)
     l4_uint8_t mac[6];
-    // currently not used ...
+    // The link status (if VIRTIO_NET_F_STATUS aka Features::status)
     l4_uint16_t status;
     l4_uint16_t max_virtqueue_pairs;
   };
 
   L4virtio::Svr::Dev_config_t<Net_config_space> _dev_config;
 
-  explicit Virtio_net(unsigned vq_max)
+  /**
+   * Create a Virtio net device.
+   *
+   * \param vq_max    Maximum number of entries in a virtqueue.
+   * \param announce  Offer a control queue and ask the guest to announce
+   *                  itself after it started the device.
+   */
+  Virtio_net(unsigned vq_max, bool announce)
   : L4virtio::Svr::Device(&_dev_config),
-    _dev_config(L4VIRTIO_VENDOR_KK, L4VIRTIO_ID_NET, 2),
-    _vq_max(vq_max)
+    _dev_config(L4VIRTIO_VENDOR_KK, L4VIRTIO_ID_NET, announce ? 3 : 2),
+    _vq_max(vq_max),
+    _num_queues(announce ? 3 : 2)
   {
     Features hf(0);
     hf.ring_indirect_desc() = true;
     hf.mrg_rxbuf() = true;
+    if (announce)
+      {
+        // The specification requires a control queue for announcements.
+        hf.status() = true;
+        hf.ctrl_vq() = true;
+        hf.guest_announce() = true;
+      }
 #if 0
     // disable currently unsupported options, but leave them in for
     // documentation purposes
@@ -167,6 +251,9 @@ public:
 
     reset_queue_config(Rx, vq_max);
     reset_queue_config(Tx, vq_max);
+    if (_num_queues > Ctrl)
+      reset_queue_config(Ctrl, vq_max);
+    _dev_config.priv_config()->status = Status_link_up;
   }
 
   void reset() override
@@ -176,9 +263,57 @@ public:
 
     reset_queue_config(Rx, _vq_max);
     reset_queue_config(Tx, _vq_max);
+    if (_num_queues > Ctrl)
+      reset_queue_config(Ctrl, _vq_max);
+    _dev_config.priv_config()->status = Status_link_up;
     _dev_config.reset_hdr();
   }
 
+  /**
+   * Offer checksum and UDP segmentation offloading.
+   *
+   * Must be called before the guest negotiates the features. Packets a
+   * guest sends with these offloads are converted in software for guests
+   * that did not negotiate them, see Sw_offload.
+   */
+  void enable_uso()
+  {
+    Features hf = _dev_config.host_features(0);
+    hf.csum() = true;
+    hf.guest_csum() = true;
+    _dev_config.host_features(0) = hf.raw;
+    _dev_config.set_host_feature(Feature_guest_uso4);
+    _dev_config.set_host_feature(Feature_guest_uso6);
+    _dev_config.set_host_feature(Feature_host_uso);
+    _dev_config.reset_hdr();
+  }
+
+  /**
+   * Offer large receive packets to the guest, see Tcp_gro.
+   *
+   * Must be called before the guest negotiates the features.
+   */
+  void enable_gro()
+  {
+    Features hf = _dev_config.host_features(0);
+    hf.guest_csum() = true;
+    hf.guest_tso4() = true;
+    hf.guest_tso6() = true;
+    _dev_config.host_features(0) = hf.raw;
+    _dev_config.reset_hdr();
+  }
+
+  /** Check whether the guest negotiated a feature given by its bit number. */
+  bool guest_feature(Feature_bit bit) const
+  {
+    return _dev_config.hdr()->driver_features_map[bit / 32]
+           & (1U << (bit % 32));
+  }
+
+  /** Get the features negotiated by the guest. */
+  Features guest_features() const
+  { return Features(_dev_config.hdr()->driver_features_map[0]); }
+
   template<typename T, unsigned N >
   static unsigned array_length(T (&)[N]) { return N; }
 
@@ -188,7 +323,7 @@ public:
       .printf("(%p): Reconfigure queue %d (%p): Status: %02x\n",
               this, index, _q + index, _dev_config.status().raw);
 
-    if (index >= array_length(_q))
+    if (index >= _num_queues)
       return -L4_ERANGE;
 
     if (setup_queue(_q + index, index, _vq_max))
@@ -218,20 +353,91 @@ public:
     dump_features(info, hdr->driver_features_map);
   }
 
-  /** Check whether both virtqueues are ready. */
+  /**
+   * Check whether the virtqueues are ready.
+   *
+   * The control queue is only required if the guest negotiated it. A guest
+   * that supports announcements is asked to announce itself right away, so
+   * the MAC tables learn its new location after a migration without waiting
+   * for the guest to send traffic.
+   */
   bool check_queues() override
   {
-    for (L4virtio::Svr::Virtqueue &q: _q)
-      if (!q.ready())
+    Features gf = guest_features();
+    for (unsigned i = 0; i < array_length(_q); ++i)
+      if (!_q[i].ready() && (i != Ctrl || gf.ctrl_vq()))
         {
           reset();
           Err().printf("failed to start queues\n");
           return false;
         }
     dump_features();
+
+    if (gf.guest_announce())
+      {
+        _dev_config.priv_config()->status |= Status_announce;
+        trigger_driver_config_irq();
+      }
     return true;
   }
 
+  /**
+   * Handle the requests on the control queue.
+   *
+   * Only the acknowledgement of an announcement is supported, all other
+   * commands are rejected.
+   */
+  void handle_ctrl_queue()
+  {
+    Virtqueue *q = &_q[Ctrl];
+    if (L4_LIKELY(!q->ready()))
+      return;
+
+    L4virtio::Svr::Request_processor req_proc;
+    Ctrl_buffer buf;
+
+    while (auto req = q->next_avail())
+      {
+        auto head = req_proc.start(mem_info(), req, &buf);
+
+        l4_uint8_t ack = Ctrl_err;
+        if (buf.left >= sizeof(Ctrl_hdr))
+          {
+            auto *hdr = reinterpret_cast<Ctrl_hdr const *>(buf.pos);
+            if (hdr->cls == Ctrl_announce && hdr->cmd == Ctrl_announce_ack)
+              {
+                _dev_config.priv_config()->status &= ~Status_announce;
+                ack = Ctrl_ok;
+              }
+            else
+              Dbg(Dbg::Virtio, Dbg::Info, "Virtio")
+                .printf("Unsupported control command %u/%u\n",
+                        hdr->cls, hdr->cmd);
+          }
+
+        // The acknowledgement goes into the last buffer, which must be
+        // device writable. A guest might hand in read-only memory otherwise.
+        Ctrl_buffer status = buf;
+        try
+          {
+            while (req_proc.next(mem_info(), &buf))
+              status = buf;
+          }
+        catch (L4virtio::Svr::Bad_descriptor const &)
+          {
+            status = Ctrl_buffer();
+          }
+
+        l4_uint32_t written = 0;
+        if (status.writable && status.left >= sizeof(ack))
+          {
+            *reinterpret_cast<l4_uint8_t *>(status.pos) = ack;
+            written = sizeof(ack);
+          }
+        q->finish(head, this, written);
+      }
+  }
+
   Server_iface *server_iface() const override
   { return L4::Epiface::server_iface(); }
 
@@ -270,12 +476,18 @@ public:
       }
   }
 
-  void kick_emit_and_enable()
+  /**
+   * Enable guest notifications and trigger a pending one.
+   *
+   * \param queues  The queues to handle.
+   */
+  void kick_emit_and_enable(unsigned queues = All_queues)
   {
     bool kick_pending = false;
 
-    for (auto &q : _q)
-      kick_pending |= q.kick_enable_get_pending();
+    for (unsigned i = 0; i < array_length(_q); ++i)
+      if (queues & (1U << i))
+        kick_pending |= _q[i].kick_enable_get_pending();
 
     if (kick_pending)
       {
@@ -284,10 +496,16 @@ public:
       }
   }
 
-  void kick_disable_and_remember()
+  /**
+   * Defer guest notifications until `kick_emit_and_enable()`.
+   *
+   * \param queues  The queues to handle.
+   */
+  void kick_disable_and_remember(unsigned queues = All_queues)
   {
-    for (auto &q : _q)
-      q.kick_disable_and_remember();
+    for (unsigned i = 0; i < array_length(_q); ++i)
+      if (queues & (1U << i))
+        _q[i].kick_disable_and_remember();
   }
 
   /** Getter for the transmission queue. */
@@ -302,8 +520,10 @@ public:
 private:
   /** Maximum number of entries in a virtqueue that is used by the port */
   unsigned _vq_max;
-  /** the two used virtqueues */
-  Virtqueue _q[2];
+  /** Number of virtqueues offered, the control queue only on request */
+  unsigned _num_queues;
+  /** the used virtqueues: receive, transmit and control queue */
+  Virtqueue _q[3];
   /**
    * The IRQ used to notify the associated client that a new network request
    * has been received and is present in the receive queue.
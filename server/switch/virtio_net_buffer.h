@@ -32,6 +32,13 @@ struct Buffer : L4virtio::Svr::Data_buffer
 
   template<typename T>
   explicit Buffer(T *p) : Data_buffer(p) {};
+
+  /** Buffer of `len` bytes at `p`. */
+  Buffer(void *p, l4_uint32_t len)
+  {
+    pos = static_cast<char *>(p);
+    left = len;
+  }
 };
 
 /**\}*/
@@ -149,6 +149,16 @@ public:
         else
           hdr->csum_start += 4U;
       }
+
+    // The headers of segmented packets include the Ethernet header.
+    if (   L4_UNLIKELY(_tci != 0 && hdr->hdr_len)
+        && hdr->gso_type != Virtio_net::Hdr::Gso_none)
+      {
+        if (_tci == 0xffffU)
+          hdr->hdr_len -= 4U;
+        else
+          hdr->hdr_len += 4U;
+      }
   }
 };
 